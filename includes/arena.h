@@ -0,0 +1,36 @@
+#ifndef CLOX_ARENA_H
+#define CLOX_ARENA_H
+
+#include "common.h"
+#include "memory.h"
+
+// Region allocator: allocations are bumped into blocks and never freed on their own,
+// the whole arena is released at once. Growing an array allocates it again and leaves
+// the old one behind, that costs at most as much as the array itself.
+
+#ifndef CLOX_ARENA_BLOCK_SIZE
+#define CLOX_ARENA_BLOCK_SIZE (16 * 1024)
+#endif // CLOX_ARENA_BLOCK_SIZE
+
+#ifndef CLOX_ARENA_ALIGN
+#define CLOX_ARENA_ALIGN 16
+#endif // CLOX_ARENA_ALIGN
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} arena_block_t;
+
+typedef struct arena
+{
+    arena_block_t *blocks; // The one allocated from first
+} arena_t;
+
+void arena_init(arena_t *);
+void *arena_allocate(arena_t *, size_t);
+void arena_free(arena_t *);
+
+#endif // CLOX_ARENA_H
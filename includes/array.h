@@ -6,38 +6,76 @@
 
 typedef size_t array_size_t;
 
-#define ARRAY(name, type)                           \
-    typedef struct                                  \
-    {                                               \
-        type *items;                                \
-        array_size_t count;                         \
-        array_size_t capacity;                      \
-    } name##_t;                                     \
-    void name##_init(name##_t *array);              \
-    void name##_write(name##_t *array, type value); \
+// Growable arrays reallocated in place. Reserving ahead or appending in bulk grows
+// them once, shrinking trims the capacity to the count once they're complete.
+#define ARRAY(name, type)                                                        \
+    typedef struct                                                               \
+    {                                                                            \
+        type *items;                                                             \
+        array_size_t count;                                                      \
+        array_size_t capacity;                                                   \
+    } name##_t;                                                                  \
+    void name##_init(name##_t *array);                                           \
+    void name##_reserve(name##_t *array, array_size_t capacity);                 \
+    void name##_write(name##_t *array, type value);                              \
+    void name##_append(name##_t *array, const type *values, array_size_t count); \
+    void name##_shrink_to_fit(name##_t *array);                                  \
     void name##_free(name##_t *array);
 
-#define ARRAY_IMPL(name, type)                                                                                   \
-    void name##_init(name##_t *array)                                                                            \
-    {                                                                                                            \
-        (array)->capacity = 0;                                                                                   \
-        (array)->count = 0;                                                                                      \
-        (array)->items = NULL;                                                                                   \
-    }                                                                                                            \
-    void name##_write(name##_t *array, type value)                                                               \
-    {                                                                                                            \
-        if ((array)->count >= (array)->capacity)                                                                 \
-        {                                                                                                        \
-            (array)->capacity = GROW_CAPACITY((array)->capacity);                                                \
-            (array)->items = (type *)memory_allocate((array)->items, ((array)->capacity * sizeof(type)), false); \
-        }                                                                                                        \
-        (array)->items[(array)->count] = (value);                                                                \
-        (array)->count++;                                                                                        \
-    }                                                                                                            \
-    void name##_free(name##_t *array)                                                                            \
-    {                                                                                                            \
-        memory_free((array)->items);                                                                             \
-        name##_init(array);                                                                                      \
+#define ARRAY_IMPL(name, type)                                                                            \
+    void name##_init(name##_t *array)                                                                     \
+    {                                                                                                     \
+        (array)->capacity = 0;                                                                            \
+        (array)->count = 0;                                                                               \
+        (array)->items = NULL;                                                                            \
+    }                                                                                                     \
+    void name##_reserve(name##_t *array, array_size_t capacity)                                           \
+    {                                                                                                     \
+        if (capacity <= (array)->capacity)                                                                \
+            return;                                                                                       \
+        (array)->items = (type *)memory_allocate((array)->items, capacity * sizeof(type), false);         \
+        (array)->capacity = capacity;                                                                     \
+    }                                                                                                     \
+    void name##_write(name##_t *array, type value)                                                        \
+    {                                                                                                     \
+        if ((array)->count >= (array)->capacity)                                                          \
+        {                                                                                                 \
+            if ((array)->capacity > 0)                                                                    \
+                memory_count_growth();                                                                    \
+            name##_reserve(array, GROW_CAPACITY((array)->capacity));                                      \
+        }                                                                                                 \
+        (array)->items[(array)->count] = (value);                                                         \
+        (array)->count++;                                                                                 \
+    }                                                                                                     \
+    void name##_append(name##_t *array, const type *values, array_size_t count)                           \
+    {                                                                                                     \
+        if ((array)->count + count > (array)->capacity)                                                   \
+        {                                                                                                 \
+            if ((array)->capacity > 0)                                                                    \
+                memory_count_growth();                                                                    \
+            array_size_t capacity = GROW_CAPACITY((array)->capacity);                                     \
+            name##_reserve(array, capacity > (array)->count + count ? capacity : (array)->count + count); \
+        }                                                                                                 \
+        if (count > 0)                                                                                    \
+            memcpy((array)->items + (array)->count, values, count * sizeof(type));                        \
+        (array)->count += count;                                                                          \
+    }                                                                                                     \
+    void name##_shrink_to_fit(name##_t *array)                                                            \
+    {                                                                                                     \
+        if ((array)->count == (array)->capacity)                                                          \
+            return;                                                                                       \
+        if ((array)->count == 0)                                                                          \
+        {                                                                                                 \
+            name##_free(array);                                                                           \
+            return;                                                                                       \
+        }                                                                                                 \
+        (array)->items = (type *)memory_allocate((array)->items, (array)->count * sizeof(type), false);   \
+        (array)->capacity = (array)->count;                                                               \
+    }                                                                                                     \
+    void name##_free(name##_t *array)                                                                     \
+    {                                                                                                     \
+        memory_free((array)->items);                                                                      \
+        name##_init(array);                                                                               \
     }
 
 #endif // CLOX_ARRAY_H
@@ -10,6 +10,10 @@
 #include <math.h>
 #include <assert.h>
 
+#ifndef CLOX_VERSION
+#define CLOX_VERSION __DATE__ " " __TIME__ // Build stamp unless a release sets it
+#endif // CLOX_VERSION
+
 #define NOT_IMPLEMENTED assert(0 && "Not Implemented")
 #define UNREACHABLE     assert(0 && "Unreachable")
 #define UNUSED          __attribute__((unused))
@@ -18,6 +22,9 @@ typedef struct object object_t;
 typedef struct object_string object_string_t;
 typedef struct object_function object_function_t;
 typedef struct object_native object_native_t;
+typedef struct object_module object_module_t;
+typedef struct object_builder object_builder_t;
+typedef struct object_rope object_rope_t;
 
 typedef enum cmp
 {
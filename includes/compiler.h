@@ -5,15 +5,31 @@
 #include "tokenizer.h"
 #include "program.h"
 #include "object.h"
+#include "ir.h"
+#include "arena.h"
 
 #ifndef CLOX_LOCALS_MAX
 #define CLOX_LOCALS_MAX (UINT8_MAX + 1)
 #endif // CLOX_LOCALS_MAX
 
+// Local slots are encoded as a 16-bit operand
+#if CLOX_LOCALS_MAX > (UINT16_MAX + 1)
+#error "CLOX_LOCALS_MAX can't be larger than UINT16_MAX + 1"
+#endif
+
+// A frame of that many locals has to fit in the value stack, with its callee below it
+#if CLOX_LOCALS_MAX >= CLOX_VALUE_STACK_MAX
+#error "CLOX_LOCALS_MAX has to be smaller than CLOX_VALUE_STACK_MAX"
+#endif
+
 #ifndef CLOX_PARAMETERS_MAX
 #define CLOX_PARAMETERS_MAX (UINT8_MAX + 1)
 #endif // CLOX_PARAMETERS_MAX
 
+#ifndef CLOX_SOURCE_PER_CHUNK
+#define CLOX_SOURCE_PER_CHUNK 4 // Bytes of source per byte of bytecode, to reserve the main function
+#endif // CLOX_SOURCE_PER_CHUNK
+
 #ifndef CLOX_MAIN_FN
 #define CLOX_MAIN_FN "main"
 #endif // CLOX_MAIN_FN
@@ -25,20 +41,36 @@ typedef enum compiler_error
     COMPILER_ERROR_EXPRESSION_EXPECTED,
     COMPILER_ERROR_INVALID_ASSIGNMENT,
     COMPILER_ERROR_OUT_OF_MEMORY,
+    COMPILER_ERROR_TOO_MANY_LOCALS,
+    COMPILER_ERROR_CONSTANT_EXPECTED,
 
     COMPILER_ERROR_COUNT
 } compiler_error_t;
 
 typedef struct compiler_local
 {
-    token_t token;
+    const char *name;
+    size_t length;
+    uint32_t hash;
     size_t depth;
+    size_t slot;    // Variables only
+    bool constant;  // Declared with 'const', uses are replaced by its value
+    value_t value;
+    int next; // Previous local in the same bucket, -1 if none
 } compiler_local_t;
 
+// Locals live on a stack (in declaration order) and are indexed by a chained hash
+// table whose buckets point to the innermost local, so shadowing and scope exits
+// are handled by relinking the bucket head. Consts share the table (global ones
+// stay at depth 0 of the main function) but don't take a stack slot.
 typedef struct compiler_locals
 {
-    compiler_local_t items[CLOX_LOCALS_MAX];
+    compiler_local_t *items;
     size_t count;
+    size_t capacity;
+    size_t slots;
+    int *buckets;
+    size_t buckets_count;
     size_t depth;
 } compiler_locals_t;
 
@@ -47,12 +79,29 @@ typedef struct compiler_context
     struct compiler_context *enclosing;
     object_function_t *function;
     compiler_locals_t locals;
+    size_t operand_start; // Where the left operand of the infix being compiled starts
 } compiler_context_t;
 
+typedef struct compiler_options
+{
+    const ir_pipeline_t *pipeline; // NULL compiles in a single pass
+    bool lazy;                     // Function bodies are compiled on their first call
+    bool pretokenize;              // The whole source is tokenized before parsing
+    size_t threads;                // Tokenizer threads when pretokenizing, 0 for one per core
+    bool cache;                    // Imported modules are cached as images next to their source
+    bool incremental;              // Later units may define the globals again (REPL, streaming)
+    size_t first_line;             // Of the source in its script when streamed, 0 is taken as 1
+    compiler_context_t *globals;   // Main function's context, lazy bodies see its consts
+} compiler_options_t;
+
+// Contexts and their locals live in the arena, released by compiler_free. The main
+// context outlives compiler_run, lazy bodies are compiled against it.
 typedef struct compiler
 {
     tokenizer_context_t tokenizer_context;
     compiler_context_t *context;
+    compiler_options_t options;
+    arena_t arena;
 } compiler_t;
 
 typedef enum precedence
@@ -81,12 +130,14 @@ typedef struct rule
     precedence_t precedence;
 } rule_t;
 
-void compiler_init(compiler_t *, tokenizer_t *);
+void compiler_init(compiler_t *, tokenizer_t *, const token_stream_t *, const compiler_options_t *);
 void compiler_free(compiler_t *);
 void compiler_error(compiler_t *, const char *fmt, ...);
-compiler_error_t compiler_run(compiler_t *, const char *);
+compiler_error_t compiler_run(compiler_t *, const char *, const compiler_options_t *);
+compiler_error_t compiler_run_function(object_function_t *, const compiler_options_t *);
 
-compiler_context_t *compiler_context_new(compiler_context_t *, const char *);
+compiler_context_t *compiler_context_new(arena_t *, compiler_context_t *, object_function_t *);
+// Ends the function, the context's memory goes with the arena
 object_function_t *compiler_context_destroy(compiler_context_t *);
 
 #endif // CLOX_COMPILER_H
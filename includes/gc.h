@@ -0,0 +1,101 @@
+#ifndef CLOX_GC_H
+#define CLOX_GC_H
+
+#include "common.h"
+#include "value.h"
+#include "object.h"
+#include "table.h"
+#include "compiler.h"
+
+// Tracing mark-and-sweep collector. Every object made by object_new is linked in a
+// single list and owned by the collector, nothing else frees them. Collections only
+// start at the safepoints of the VM, between instructions, where every live object is
+// reachable from its roots: objects the compiler or the image reader hold in C locals
+// can't be freed under them. The tokenizer threads never make objects, so the
+// collector is only ever used by the main thread.
+//
+// Strings are interned in a set the collector doesn't mark through: a string only
+// there is freed, and leaves it. Young strings are interned too, minor collections
+// replace them with their copy.
+//
+// Strings the VM makes while running start in a nursery, a block they are bumped
+// into header and characters together. The ones still reachable at a safepoint are
+// copied to the old space (the list above) and their references patched, then the
+// nursery is reused whole. Only the value stack and the global tables can refer to
+// young objects: stores into a table go through gc_barrier, which remembers the
+// tables to patch. Builders and ropes copy characters in, and a rope only refers to
+// old objects, so they need no barrier.
+
+#ifndef CLOX_GC_HEAP_MIN
+#define CLOX_GC_HEAP_MIN (1024 * 1024) // Bytes allocated before the first collection
+#endif // CLOX_GC_HEAP_MIN
+
+#ifndef CLOX_GC_GROWTH
+#define CLOX_GC_GROWTH 2 // Next collection once the heap is this many times what survived
+#endif // CLOX_GC_GROWTH
+
+#ifndef CLOX_GC_NURSERY_SIZE
+#define CLOX_GC_NURSERY_SIZE (256 * 1024) // Bytes, 0 allocates everything in the old space
+#endif // CLOX_GC_NURSERY_SIZE
+
+#ifndef CLOX_GC_STRESS
+#define CLOX_GC_STRESS 0 // Collects at every safepoint, to find missing roots
+#endif // CLOX_GC_STRESS
+
+typedef struct gc_stats
+{
+    size_t minor_collections;
+    size_t young_objects;    // Allocated in the nursery
+    size_t promoted_objects; // Copied out of it
+    size_t collections;
+    size_t objects;       // Live, or allocated since the last collection
+    size_t bytes;         // Estimated, recounted from the survivors at each collection
+    size_t next;          // Bytes that start the next collection
+    size_t peak;          // Largest bytes seen
+    size_t freed_objects; // Over all collections
+    size_t freed_bytes;
+    size_t allocated[OBJECT_COUNT]; // Objects made over the whole run, young ones included
+} gc_stats_t;
+
+void gc_track(object_t *, size_t bytes);
+// Memory an object already tracked took since, recounted at the next collection
+void gc_grow(size_t bytes);
+// NULL when it doesn't fit, the caller allocates in the old space then
+object_t *gc_allocate_young(object_type_t, size_t size);
+bool gc_pressure(void);
+
+// A young string is only returned when young is set, it's promoted for other callers:
+// they may keep it where minor collections don't look
+object_string_t *gc_intern_find(const char *, size_t, uint32_t hash, bool young);
+void gc_intern(object_string_t *);
+
+void gc_remember(table_t *);
+
+static inline void gc_barrier(table_t *table, value_t value)
+{
+    if (IS_OBJECT(value) && AS_OBJECT(value)->young)
+        gc_remember(table);
+}
+
+// The caller promotes the young objects its roots refer to, then gc_minor those of
+// the remembered tables and empties the nursery
+void gc_promote(value_t *);
+void gc_minor(void);
+bool gc_major_pressure(void);
+
+void gc_mark_object(object_t *);
+void gc_mark_value(value_t);
+void gc_mark_table(const table_t *);
+void gc_mark_context(const compiler_context_t *);
+
+// The caller has run a minor collection and marked its roots
+void gc_sweep(void);
+// Frees every object, at exit
+void gc_free(void);
+
+const gc_stats_t *gc_stats(void);
+// Walks the old space, young objects aren't counted
+void gc_census(size_t objects[OBJECT_COUNT], size_t bytes[OBJECT_COUNT]);
+void gc_stats_print(void);
+
+#endif // CLOX_GC_H
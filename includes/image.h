@@ -0,0 +1,77 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "ir.h"
+
+// Compiled functions and heaps written to a flat binary image and read back without
+// the tokenizer or the compiler. The image holds every object once, in an order where
+// an object only refers to the ones before it, by index rather than by address, so it
+// is relocatable: reading rebuilds the objects and patches the references. Everything
+// is in host byte order. Readers check the header, the bounds of every field and the
+// bytecode of every function, a bad image is rejected rather than trusted.
+
+#define CLOX_IMAGE_MAGIC "LOXC"
+
+#ifndef CLOX_IMAGE_VERSION
+#define CLOX_IMAGE_VERSION 3 // Bumped whenever the layout or the bytecode changes
+#endif // CLOX_IMAGE_VERSION
+
+#ifndef CLOX_IMAGE_EXTENSION
+#define CLOX_IMAGE_EXTENSION ".loxc"
+#endif // CLOX_IMAGE_EXTENSION
+
+typedef enum image_kind
+{
+    IMAGE_KIND_FUNCTION, // A function to run
+    IMAGE_KIND_HEAP,     // Global variables of a VM
+
+    IMAGE_KIND_COUNT
+} image_kind_t;
+
+typedef struct image_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t op_count; // OP_COUNT of the writer
+    uint32_t kind;
+    uint64_t key;      // Identifies what the image was built from, 0 when not tied to a source
+    uint64_t length;   // Bytes following the header
+    uint64_t checksum; // Of the bytes following the header
+} image_header_t;
+
+typedef struct image_buffer
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} image_buffer_t;
+
+uint64_t image_hash(const void *data, size_t length, uint64_t seed);
+void image_buffer_free(image_buffer_t *);
+
+// Fail on functions that can't be stored: natives, lazy functions not compiled yet and
+// functions bound to a module's namespace or the builtins', a reader couldn't bind them back
+bool image_write(image_buffer_t *, const object_function_t *, uint64_t key);
+object_function_t *image_read(const void *data, size_t length, uint64_t key);
+
+// Natives are skipped, the VM defines them again, and so are modules, imported again,
+// and builders. Ropes are read back as strings. A global holding a function of a module
+// or of the prelude fails the whole heap.
+bool image_write_heap(image_buffer_t *, const table_t *globals, uint64_t key);
+bool image_read_heap(const void *data, size_t length, uint64_t key, table_t *globals);
+
+// Writes a temporary file renamed over the path so that readers never see it half
+// written. Images are read back through a mapping.
+bool image_save(const char *path, const image_buffer_t *);
+
+// Cache file next to the script, keyed by its text, the interpreter that compiled it
+// and the optimization passes
+uint64_t image_cache_key(const char *source, size_t length, const ir_pipeline_t *);
+char *image_cache_path(const char *script);
+object_function_t *image_cache_load(const char *path, uint64_t key);
+bool image_cache_save(const char *path, const object_function_t *, uint64_t key);
+
+#endif // CLOX_IMAGE_H
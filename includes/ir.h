@@ -0,0 +1,126 @@
+#ifndef CLOX_IR_H
+#define CLOX_IR_H
+
+#include "common.h"
+#include "value.h"
+#include "program.h"
+#include "object.h"
+
+// Optimization tier: a function's bytecode is lifted into basic blocks of stack
+// instructions, passes rewrite them and they are lowered back to bytecode. It isn't
+// SSA: slots of the frame, locals included, are tracked by position, and an abstract
+// run of each block links the values an instruction consumes to the instructions of
+// the block that pushed them. Values from other blocks are IR_INPUT, there are no
+// phis, and only the lattice of a slot is merged where blocks meet. Within a block
+// every value gets a number, a copy made by OP_GET_LOCAL keeps the number it copies.
+
+typedef enum ir_lattice_kind
+{
+    IR_LATTICE_UNDEFINED,
+    IR_LATTICE_CONSTANT,
+    IR_LATTICE_UNKNOWN,
+
+    IR_LATTICE_COUNT
+} ir_lattice_kind_t;
+
+typedef struct ir_lattice
+{
+    ir_lattice_kind_t kind;
+    value_t value;
+} ir_lattice_t;
+
+#define IR_INPUT (-1) // Value defined in a predecessor block
+
+typedef struct ir_instruction
+{
+    op_code_t op;
+    value_t constant;   // Operand of OP_CONSTANT and of the global instructions
+    size_t operand;     // Local slot, arguments count or target instruction
+    size_t slots[2];    // Counter and limit of the counted loops
+    int args[2];        // Defining instructions of the consumed values (the callee for OP_CALL)
+    int values[2];      // Value numbers of the consumed values
+    size_t height;      // Stack height before the instruction
+    size_t available;   // Lowest slot already holding its value, SIZE_MAX when none does
+    size_t uses;
+    ir_lattice_t result;
+    bool dead;
+} ir_instruction_t;
+
+typedef struct ir_block
+{
+    size_t start;
+    size_t end;
+    size_t height;        // Stack height (relative to the frame pointer) at entry
+    ir_lattice_t *entry;  // One per stack slot at entry
+    bool reachable;
+} ir_block_t;
+
+#ifndef CLOX_INLINE_MAX
+#define CLOX_INLINE_MAX 16 // Instructions
+#endif // CLOX_INLINE_MAX
+
+// Body of a top-level function that is defined once, never assigned and small
+// enough to be inlined: straight-line code without calls up to its first OP_RETURN
+typedef struct ir_inline_body
+{
+    object_function_t *function;
+    ir_instruction_t *instructions;
+    size_t count;
+    size_t height;  // Values under the result at the OP_RETURN
+    size_t defined; // Offset of its OP_DEFINE_GLOBAL in the main function
+} ir_inline_body_t;
+
+// Functions compiled together, known once the whole source has been compiled
+typedef struct ir_unit
+{
+    object_function_t *main;
+    object_function_t **functions;
+    size_t functions_count;
+    ir_inline_body_t *inlinable;
+    size_t inlinable_count;
+    size_t *created; // Per function, offset of the main function's OP_CONSTANT that makes
+                     // it or the top-level function enclosing it, SIZE_MAX when none does
+} ir_unit_t;
+
+typedef struct ir_function
+{
+    const ir_unit_t *unit; // NULL when optimized on its own
+    object_function_t *function;
+    ir_instruction_t *instructions;
+    size_t count;
+    ir_block_t *blocks;
+    size_t blocks_count;
+} ir_function_t;
+
+typedef bool (*ir_pass_fn)(ir_function_t *);
+
+typedef struct ir_pass
+{
+    const char *name;
+    ir_pass_fn run;
+} ir_pass_t;
+
+#ifndef CLOX_IR_PIPELINE_MAX
+#define CLOX_IR_PIPELINE_MAX 16
+#endif // CLOX_IR_PIPELINE_MAX
+
+typedef struct ir_pipeline
+{
+    const ir_pass_t *passes[CLOX_IR_PIPELINE_MAX];
+    size_t count;
+} ir_pipeline_t;
+
+bool ir_build(ir_function_t *, object_function_t *);
+bool ir_analyze(ir_function_t *);
+bool ir_lower(ir_function_t *, program_t *);
+void ir_free(ir_function_t *);
+void ir_print(const ir_function_t *);
+
+const ir_pass_t *ir_pass_find(const char *name, size_t length);
+void ir_pipeline_default(ir_pipeline_t *);
+bool ir_pipeline_parse(ir_pipeline_t *, const char *);
+bool ir_optimize(object_function_t *, const ir_pipeline_t *);
+// Calls to the unit's functions are only inlined when no later unit can redefine them
+void ir_optimize_unit(object_function_t *, const ir_pipeline_t *, bool inline_calls);
+
+#endif // CLOX_IR_H
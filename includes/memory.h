@@ -7,4 +7,56 @@
 void *memory_allocate(void *, size_t, bool zinit);
 void memory_free(void *);
 
+// Process wide, the tokenizer threads allocate too so the counters are atomic. Every
+// block starts with its size so that frees are accounted.
+typedef struct memory_stats
+{
+    size_t allocations; // Including reallocations
+    size_t frees;
+    size_t bytes;       // Live
+    size_t peak;        // Largest live bytes
+    size_t total;       // Allocated over the whole run
+    size_t growths;     // Arrays, tables and token streams that grew
+} memory_stats_t;
+
+memory_stats_t memory_stats(void);
+void memory_count_growth(void);
+
+// Objects come from pools of fixed size slots, one per size class, carved out of slabs
+// and recycled through a free list. Larger sizes go to malloc. Slabs are only released
+// at exit. The pools aren't locked, only the main thread makes objects.
+
+#ifndef CLOX_MEMORY_POOLS
+#define CLOX_MEMORY_POOLS 1 // 0 uses malloc for every size, for memory checkers
+#endif // CLOX_MEMORY_POOLS
+
+#ifndef CLOX_MEMORY_POOL_GRANULE
+#define CLOX_MEMORY_POOL_GRANULE 16 // Bytes between size classes, and their alignment
+#endif // CLOX_MEMORY_POOL_GRANULE
+
+#ifndef CLOX_MEMORY_POOL_CLASSES
+#define CLOX_MEMORY_POOL_CLASSES 8 // Up to 128 bytes
+#endif // CLOX_MEMORY_POOL_CLASSES
+
+#ifndef CLOX_MEMORY_POOL_SLAB
+#define CLOX_MEMORY_POOL_SLAB (16 * 1024)
+#endif // CLOX_MEMORY_POOL_SLAB
+
+typedef struct memory_pool_stats
+{
+    size_t size; // Of the slots
+    size_t allocations;
+    size_t frees;
+    size_t live;
+    size_t peak;
+    size_t slabs;
+} memory_pool_stats_t;
+
+// The size freed is the one allocated
+void *memory_pool_allocate(size_t);
+void memory_pool_free(void *, size_t);
+const memory_pool_stats_t *memory_pool_stats(size_t size_class);
+void memory_pools_print(void);
+void memory_pools_free(void);
+
 #endif // CLOX_MEMORY_H
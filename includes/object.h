@@ -11,6 +11,9 @@ typedef enum object_type
     OBJECT_STRING,
     OBJECT_FUNCTION,
     OBJECT_NATIVE,
+    OBJECT_MODULE,
+    OBJECT_BUILDER,
+    OBJECT_ROPE,
 
     OBJECT_COUNT
 } object_type_t;
@@ -18,13 +21,17 @@ typedef enum object_type
 struct object
 {
     object_type_t type;
+    bool marked;         // Forwarded when young
+    bool young;
+    struct object *next; // Every object the collector tracks, the copy of a forwarded one
 };
 
 struct object_string
 {
     object_t object;
     size_t length;
-    char* data;
+    uint32_t hash; // Of the characters, computed once when the string is made
+    char data[];   // Allocated with the header, short strings fit a pool slot
 };
 
 struct object_function
@@ -33,6 +40,9 @@ struct object_function
     object_string_t *name;
     size_t arity;
     program_t program;
+    const char *source; // Lazy functions only, from '(' to the end of the body until compiled
+    size_t source_line;
+    struct table *globals; // Namespace of the module defining it, NULL for the script's
 };
 
 typedef value_t (*native_fn)(size_t args_count, value_t *args);
@@ -43,30 +53,91 @@ struct object_native
     native_fn function;
 };
 
+// Script imported by name, compiled and run in its own namespace on first use
+struct object_module
+{
+    object_t obj;
+    object_string_t *name;
+    struct table *globals;
+    bool loaded;
+};
+
+#ifndef CLOX_ROPE_MIN
+#define CLOX_ROPE_MIN 256 // Characters, shorter concatenations are interned right away
+#endif // CLOX_ROPE_MIN
+
+// Characters appended in place, by the builder natives and by concatenations
+struct object_builder
+{
+    object_t obj;
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Concatenation not flattened yet, the first length characters of a builder. Adding
+// to the last rope of a chain appends to its builder, the ropes before it only see
+// their own prefix, so building a string piece by piece doesn't copy it every time.
+struct object_rope
+{
+    object_t obj;
+    object_builder_t *builder;
+    size_t length;
+    object_string_t *flat; // Interned the first time it's used as a string
+};
+
 #define OBJECT_TYPE(value) (AS_OBJECT(value)->type)
+#define STRING_SIZE(length) (sizeof(object_string_t) + (length))
 
 #define IS_STRING(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_STRING)
 #define IS_FUNCTION(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_FUNCTION)
 #define IS_NATIVE(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_NATIVE)
+#define IS_MODULE(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_MODULE)
+#define IS_BUILDER(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_BUILDER)
+#define IS_ROPE(value) (IS_OBJECT(value) && (AS_OBJECT(value)->type) == OBJECT_ROPE)
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value) ((object_string_t *)AS_OBJECT(value))
 #define AS_FUNCTION(value) ((object_function_t *)AS_OBJECT(value))
 #define AS_NATIVE(value) ((object_native_t *)AS_OBJECT(value))
+#define AS_MODULE(value) ((object_module_t *)AS_OBJECT(value))
+#define AS_BUILDER(value) ((object_builder_t *)AS_OBJECT(value))
 
+// Objects belong to the collector, only the sweep frees them. The destroy functions
+// release what the object holds itself, never the objects it refers to.
 object_t *object_new(const object_type_t, const size_t);
-void object_destroy(object_t *);
-cmp_t object_cmp(const object_t *, const object_t *);
+void object_destroy(object_t *, const size_t);
+void object_free(object_t *);
+const char *object_type_name(object_type_t);
+cmp_t object_cmp(object_t *, object_t *);
 void object_print(const object_t *);
 
+// Strings are interned, equal strings are the same object
 object_string_t *object_string_new(const char *, const size_t);
+object_string_t *object_string_copy(const object_string_t *); // Not interned, for the collector
 void object_string_destroy(object_string_t *);
 object_string_t *object_string_concat(object_string_t *, object_string_t *);
 bool object_string_cmp(const object_string_t *, const object_string_t *);
 
+// Texts are strings or ropes. Concatenating them makes a rope once the result is
+// long enough, consumers that need a string flatten it. Like object_string_concat,
+// the second text comes first.
+object_t *object_concat(object_t *, object_t *);
+object_string_t *object_flatten(object_t *);
+
 object_function_t *object_function_new(const char *, const size_t);
 void object_function_destroy(object_function_t *);
 
 object_native_t *object_native_new(native_fn);
 void object_native_destroy(object_native_t *);
 
+object_module_t *object_module_new(const object_string_t *name);
+void object_module_destroy(object_module_t *);
+
+object_builder_t *object_builder_new(void);
+void object_builder_append(object_builder_t *, const object_t *text);
+void object_builder_destroy(object_builder_t *);
+
+void object_rope_destroy(object_rope_t *);
+
 #endif // CLOX_OBJECT_H
@@ -0,0 +1,18 @@
+#ifndef CLOX_PRELUDE_H
+#define CLOX_PRELUDE_H
+
+#include "common.h"
+
+// Lox sources of prelude/ compiled into an image by the build and embedded as a
+// constant, it runs before any script without going through the compiler. The
+// interpreter that compiles it is built without one.
+#ifndef CLOX_PRELUDE
+#define CLOX_PRELUDE 0
+#endif // CLOX_PRELUDE
+
+#if CLOX_PRELUDE
+extern const uint8_t prelude_image[];
+extern const size_t prelude_image_length;
+#endif // CLOX_PRELUDE
+
+#endif // CLOX_PRELUDE_H
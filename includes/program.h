@@ -17,6 +17,12 @@ typedef enum op_code
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
+
+    // Modules: the module named by the constant, and the member of a module named by
+    // the constant, the module is loaded on the first one
+    OP_IMPORT,
+    OP_GET_MEMBER,
+
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_EQUAL,
@@ -34,6 +40,11 @@ typedef enum op_code
     OP_JUMP,
     OP_JUMP_IF_FALSE,
 
+    // Counted loops: counter slot, limit slot, step constant, target. Adds the step to
+    // the counter and jumps back while it is below (or equal to) the limit
+    OP_LOOP_LESS,
+    OP_LOOP_LESS_EQUAL,
+
     OP_CALL,
     OP_RETURN,
 
@@ -54,10 +65,15 @@ typedef struct program
 } program_t;
 
 void program_init(program_t *program);
+void program_reserve(program_t *program, size_t chunks, size_t constants);
+void program_shrink(program_t *program);
+size_t program_size(const program_t *program);
 int program_write(program_t *program, op_code_t value, ...);
 void program_free(program_t *program);
 void program_disassemble(const program_t *program, const char *name);
 void program_instruction_disassemble(const program_t *program, size_t *i);
+int program_operand_size(const chunk op);
+bool program_fold(const op_code_t op, const value_t left, const value_t right, value_t *result);
 #endif // CLOX_PROGRAM_H
 
 // TODO: Keep track of lines
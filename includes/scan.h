@@ -0,0 +1,33 @@
+#ifndef CLOX_SCAN_H
+#define CLOX_SCAN_H
+
+#include "common.h"
+
+// Vectorized (SSE2 or AVX2, picked at runtime) scanning of character runs, with a
+// scalar fallback
+#ifndef CLOX_SCAN_SIMD
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CLOX_SCAN_SIMD 1
+#else
+#define CLOX_SCAN_SIMD 0
+#endif
+#endif // CLOX_SCAN_SIMD
+
+typedef enum scan_class
+{
+    SCAN_WHITESPACE, // ' ', '\t', '\r' and '\n'
+    SCAN_IDENTIFIER, // [a-zA-Z0-9_]
+    SCAN_DIGIT,      // [0-9]
+    SCAN_COMMENT,    // Anything up to '\n'
+    SCAN_STRING,     // Anything up to '"'
+
+    SCAN_CLASS_COUNT
+} scan_class_t;
+
+// Picks the version once, whichever thread calls it first
+void scan_init(void);
+// Returns the first character after the run starting at `p`, which never goes past
+// the terminating '\0', and adds the '\n' of the run to *newlines
+const char *scan_run(const char *p, const scan_class_t, size_t *newlines);
+
+#endif // CLOX_SCAN_H
@@ -0,0 +1,57 @@
+#ifndef CLOX_SOURCE_H
+#define CLOX_SOURCE_H
+
+#include "common.h"
+
+#ifndef CLOX_SOURCE_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_SOURCE_MMAP 1
+#else
+#define CLOX_SOURCE_MMAP 0
+#endif
+#endif // CLOX_SOURCE_MMAP
+
+// Script text, NUL terminated. Regular files are mapped read-only and tokens point
+// straight into the mapping, anything else (or a failed mapping) is read into memory.
+typedef struct source
+{
+    const char *data;
+    size_t length;
+    size_t mapped; // Bytes mapped, 0 if data was read into memory
+} source_t;
+
+#ifndef CLOX_SOURCE_WINDOW
+#define CLOX_SOURCE_WINDOW (64 * 1024) // Bytes read at once when streaming
+#endif // CLOX_SOURCE_WINDOW
+
+// Script read from a file in windows and handed out one top-level declaration at a
+// time. The buffer only keeps the declaration being read, it grows when a single
+// declaration doesn't fit in a window.
+typedef struct source_stream
+{
+    FILE *file;
+    char *buffer;    // NUL terminated
+    size_t capacity;
+    size_t length;
+    size_t start;    // Start of the pending declaration
+    size_t scan;     // Where scanning resumes, after the last token known to be whole
+    size_t depth;    // Parentheses and braces open at `scan`
+    size_t end;      // End of the declaration handed out last, 0 if none
+    char saved;      // Byte replaced by its terminator
+    bool eof;
+    size_t line;     // Of the pending declaration's start, in the whole script
+    int error;       // errno value once reading failed, 0 otherwise
+} source_stream_t;
+
+// Returns 0 or an errno value
+int source_open(source_t *, const char *filename);
+void source_close(source_t *);
+
+void source_stream_init(source_stream_t *, FILE *);
+void source_stream_free(source_stream_t *);
+// Next top-level declaration, NUL terminated and valid until the next call, stream->line
+// is where it starts. NULL at the end of the file or when reading fails, stream->error
+// tells them apart.
+const char *source_stream_next(source_stream_t *);
+
+#endif // CLOX_SOURCE_H
@@ -7,7 +7,11 @@
 #include "object.h"
 
 typedef uint32_t entry_hash_t;
-typedef object_string_t *entry_key_t;
+typedef object_string_t *entry_key_t; // Interned, keys are compared by address
+
+#ifndef CLOX_TABLE_MIN
+#define CLOX_TABLE_MIN 8 // Entries, capacities are powers of two
+#endif // CLOX_TABLE_MIN
 
 typedef struct entry
 {
@@ -18,7 +22,8 @@ typedef struct entry
 typedef struct table
 {
     entry_t *entries;
-    size_t count;
+    size_t count; // Deleted entries included, they take a slot until the table is rehashed
+    size_t live;  // Entries with a key
     size_t capacity;
 } table_t;
 
@@ -28,6 +33,8 @@ void table_init(table_t *);
 entry_t *table_entry_get(const table_t *, const entry_key_t);
 bool table_entry_set(table_t *, const entry_key_t, const value_t);
 bool table_entry_delete(table_t *, const entry_key_t);
+// By contents, to find the string a new one is interned as
+entry_t *table_find_string(const table_t *, const char *, const size_t, const entry_hash_t);
 void table_free(table_t *);
 void table_print(const table_t *);
 
@@ -21,8 +21,8 @@ typedef enum token_type
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
     // Keywords.
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+    TOKEN_AND, TOKEN_CLASS, TOKEN_CONST, TOKEN_ELSE, TOKEN_FALSE,
+    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
 
@@ -46,9 +46,42 @@ typedef struct tokenizer
     size_t line;
 } tokenizer_t;
 
+// Large sources are lexed in chunks on worker threads
+#ifndef CLOX_TOKENIZE_THREADS
+#if defined(__unix__)
+#define CLOX_TOKENIZE_THREADS 1
+#else
+#define CLOX_TOKENIZE_THREADS 0
+#endif
+#endif // CLOX_TOKENIZE_THREADS
+
+#ifndef CLOX_TOKENIZE_THREADS_MAX
+#define CLOX_TOKENIZE_THREADS_MAX 64
+#endif // CLOX_TOKENIZE_THREADS_MAX
+
+#ifndef CLOX_TOKENIZE_CHUNK_MIN
+#define CLOX_TOKENIZE_CHUNK_MIN (256 * 1024) // Bytes, smaller sources are lexed serially
+#endif // CLOX_TOKENIZE_CHUNK_MIN
+
+// Whole source lexed up front into parallel arrays, token i is rebuilt from the i-th
+// entry of each. Offsets are relative to the source, sources that don't fit them on
+// 32 bits are left to the tokenizer.
+typedef struct token_stream
+{
+    const char *source;
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    uint32_t *lines;
+    size_t count;
+    size_t capacity;
+} token_stream_t;
+
 typedef struct tokenizer_context
 {
     tokenizer_t *tokenizer;
+    const token_stream_t *stream; // Tokens are read from the stream when not NULL
+    size_t next;                  // Index of the next token in the stream
     token_t curr;
     token_t prev;
 } tokenizer_context_t;
@@ -57,5 +90,10 @@ void tokenizer_init(tokenizer_t *, const char *source);
 token_t tokenizer_next(tokenizer_t *);
 const char* tokenizer_token_name(const token_type_t);
 bool tokenizer_token_cmp(const token_t, const token_t);
+uint32_t tokenizer_token_hash(const token_t);
+
+bool token_stream_build(token_stream_t *, tokenizer_t *, size_t threads);
+void token_stream_free(token_stream_t *);
+token_t token_stream_get(const token_stream_t *, size_t);
 
 #endif // CLOX_TOKENIZER_H
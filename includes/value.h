@@ -46,8 +46,10 @@ bool value_addable(const value_t, const value_t);
 value_t value_add(value_t, value_t);
 void value_print(const value_t);
 
-// ValueStack
-#define CLOX_VALUE_STACK_MAX UINT8_MAX
+// ValueStack, shared by the frames of every call
+#ifndef CLOX_VALUE_STACK_MAX
+#define CLOX_VALUE_STACK_MAX (64 * (UINT8_MAX + 1)) // Values, 64 frames of 256 slots
+#endif // CLOX_VALUE_STACK_MAX
 
 typedef struct value_stack
 {
@@ -6,6 +6,7 @@
 #include "program.h"
 #include "value.h"
 #include "table.h"
+#include "compiler.h"
 
 #ifndef CLOX_FRAMES_MAX
 #define CLOX_FRAMES_MAX 64
@@ -16,6 +17,7 @@ typedef struct call_frame
     object_function_t *function;
     chunk *ip;
     value_t *fp;
+    table_t *globals; // Namespace of the function's module
 } call_frame_t;
 
 typedef struct call_frames
@@ -28,12 +30,24 @@ typedef struct vm
 {
     call_frames_t frames;
     value_stack_t stack;
-    table_t globals;
+    table_t globals;                   // The script's namespace
+    table_t builtins;                  // Natives and the prelude, seen from every namespace
+    table_t modules;                   // Every module imported so far, by name
+    const char *modules_path;          // Directory modules are read from
+    const compiler_options_t *options; // Compiles lazy functions and modules
+    size_t instructions;               // Executed, allocations are compared to them
 } vm_t;
 
 void vm_init(vm_t *);
 void vm_error(vm_t *, const char *fmt, ...);
-interpret_result_t vm_interpret(vm_t *, object_function_t *);
+interpret_result_t vm_interpret(vm_t *, object_function_t *, const compiler_options_t *);
+// Runs the function with its globals defined as builtins
+interpret_result_t vm_interpret_builtins(vm_t *, object_function_t *, const compiler_options_t *);
 void vm_free(vm_t *);
+void vm_memory_print(const vm_t *);
+
+// Globals of a VM saved after its bootstrap code ran, to start the next ones warm
+bool vm_snapshot_save(const vm_t *, const char *path);
+bool vm_snapshot_load(vm_t *, const char *path);
 
 #endif // CLOX_VM_H
@@ -0,0 +1,66 @@
+#include "arena.h"
+
+void arena_init(arena_t *arena)
+{
+    arena->blocks = NULL;
+}
+
+static size_t arena_padding(const arena_block_t *block)
+{
+    uintptr_t address = (uintptr_t)(block->data + block->used);
+    return (CLOX_ARENA_ALIGN - address % CLOX_ARENA_ALIGN) % CLOX_ARENA_ALIGN;
+}
+
+static arena_block_t *arena_block_new(size_t size)
+{
+    arena_block_t *block = (arena_block_t *)memory_allocate(NULL, sizeof(arena_block_t) + size, false);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+void *arena_allocate(arena_t *arena, size_t size)
+{
+    arena_block_t *block = arena->blocks;
+
+    // Larger allocations get a block of their own, linked after the current one so
+    // that its room is still used
+    if (size + CLOX_ARENA_ALIGN > CLOX_ARENA_BLOCK_SIZE)
+    {
+        arena_block_t *large = arena_block_new(size + CLOX_ARENA_ALIGN);
+        if (block != NULL)
+        {
+            large->next = block->next;
+            block->next = large;
+        }
+        else
+        {
+            arena->blocks = large;
+        }
+        block = large;
+    }
+    else if (block == NULL || block->used + arena_padding(block) + size > block->size)
+    {
+        block = arena_block_new(CLOX_ARENA_BLOCK_SIZE);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    block->used += arena_padding(block);
+    void *memory = block->data + block->used;
+    block->used += size;
+
+    return memory;
+}
+
+void arena_free(arena_t *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        arena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        memory_free(block);
+    }
+}
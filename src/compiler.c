@@ -1,14 +1,24 @@
 #include "compiler.h"
+#include "gc.h"
 
 static program_t *executing_program(compiler_t *);
+static void optimize(compiler_t *, object_function_t *);
+static void shrink(object_function_t *);
 
 static compiler_error_t declaration(compiler_t *);
 static compiler_error_t function_declaration(compiler_t *);
+static compiler_error_t function_body(compiler_t *, object_function_t *);
+static compiler_error_t function_skip(compiler_t *, object_function_t *);
 static compiler_error_t var_declaration(compiler_t *);
+static compiler_error_t const_declaration(compiler_t *);
+static compiler_error_t import_declaration(compiler_t *);
 static compiler_error_t statement(compiler_t *);
 static compiler_error_t statement_if(compiler_t *);
 static compiler_error_t statement_return(compiler_t *);
 static compiler_error_t statement_while(compiler_t *);
+static compiler_error_t statement_for(compiler_t *);
+static bool counted_loop_condition(compiler_t *, size_t, size_t *, op_code_t *);
+static bool counted_loop_increment(compiler_t *, size_t, size_t, value_t *);
 static compiler_error_t statement_expression(compiler_t *);
 static compiler_error_t block(compiler_t *);
 static compiler_error_t expression(compiler_t *, precedence_t);
@@ -19,9 +29,11 @@ static compiler_error_t unary(compiler_t *, UNUSED bool);
 static compiler_error_t grouping(compiler_t *, UNUSED bool);
 static compiler_error_t literal(compiler_t *, UNUSED bool);
 static compiler_error_t call(compiler_t *, UNUSED bool);
+static compiler_error_t dot(compiler_t *, UNUSED bool);
 static compiler_error_t and_(compiler_t *, UNUSED bool);
 static compiler_error_t or_(compiler_t *, UNUSED bool);
 
+static token_t next_token(tokenizer_context_t *);
 static void advance(compiler_t *);
 static bool consume_if(compiler_t *, const token_type_t);
 static compiler_error_t consume(compiler_t *, const token_type_t);
@@ -31,11 +43,20 @@ static inline token_t prev_token(compiler_t *);
 static void begin_scope(compiler_t *);
 static void end_scope(compiler_t *);
 static bool is_global_scope(compiler_t *);
-static void add_local(compiler_t *, token_t);
-static int get_local(compiler_t *, token_t);
-static void define_variable(compiler_t *, token_t);
+static void rehash_locals(arena_t *, compiler_locals_t *, size_t);
+static compiler_error_t add_local(compiler_t *, token_t, const value_t *);
+static compiler_local_t *get_local(compiler_locals_t *, token_t);
+static compiler_local_t *resolve_local(compiler_t *, token_t);
+static bool is_scoped_const(compiler_t *, token_t);
+static compiler_error_t function_compile(compiler_context_t *, object_function_t *, const compiler_options_t *);
+static compiler_error_t define_variable(compiler_t *, token_t);
 static void remove_local(compiler_t *);
 
+static compiler_error_t emit_value(compiler_t *, value_t);
+static bool read_constant(const program_t *, size_t *, value_t *);
+static void discard(compiler_t *, size_t);
+static void fold(compiler_t *, size_t);
+
 static void patch_jump_to(compiler_t *, int, int);
 static void patch_jump(compiler_t *, int);
 
@@ -46,7 +67,7 @@ static const rule_t rules[] =
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     /*dot*/NULL,    PREC_CALL},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
@@ -65,11 +86,13 @@ static const rule_t rules[] =
   [TOKEN_NUMBER]        = {literal,   NULL,   PREC_NONE},
   [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
   [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
@@ -88,12 +111,37 @@ static program_t *executing_program(compiler_t *compiler)
     return &compiler->context->function->program;
 }
 
+static void optimize(compiler_t *compiler, object_function_t *function)
+{
+    if (compiler->options.pipeline != NULL)
+        ir_optimize_unit(function, compiler->options.pipeline, !compiler->options.incremental);
+}
+
+// Trims the programs of a unit to their final size, lazy functions once compiled, and
+// counts them with the heap
+static void shrink(object_function_t *function)
+{
+    program_shrink(&function->program);
+    gc_grow(program_size(&function->program));
+
+    const value_array_t *constants = &function->program.constants;
+    for (size_t i = 0; i < constants->count; ++i)
+    {
+        if (IS_FUNCTION(constants->items[i]))
+            shrink(AS_FUNCTION(constants->items[i]));
+    }
+}
+
 static compiler_error_t declaration(compiler_t *compiler)
 {
     if (consume_if(compiler, TOKEN_FUN))
         return function_declaration(compiler);
     if (consume_if(compiler, TOKEN_VAR))
         return var_declaration(compiler);
+    if (consume_if(compiler, TOKEN_CONST))
+        return const_declaration(compiler);
+    if (consume_if(compiler, TOKEN_IMPORT))
+        return import_declaration(compiler);
     
     return statement(compiler);
 }
@@ -110,7 +158,26 @@ static compiler_error_t function_declaration(compiler_t *compiler)
     value[function_name.length] = 0;
     strncpy(value, function_name.start, function_name.length);
 
-    compiler_context_t *context = compiler_context_new(compiler->context, value);
+    object_function_t *function = object_function_new(value, 0);
+
+    if (compiler->options.lazy)
+        error = function_skip(compiler, function);
+    else
+        error = function_body(compiler, function);
+
+    if (error != 0)
+        return error;
+
+    program_write(executing_program(compiler), OP_CONSTANT, OBJECT_VAL(function));
+
+    return define_variable(compiler, function_name);
+}
+
+static compiler_error_t function_body(compiler_t *compiler, object_function_t *function)
+{
+    compiler_error_t error;
+
+    compiler_context_t *context = compiler_context_new(&compiler->arena, compiler->context, function);
     compiler->context = context;
     begin_scope(compiler);
 
@@ -131,12 +198,11 @@ static compiler_error_t function_declaration(compiler_t *compiler)
                 return error;
 
             token_t param_name = prev_token(compiler);
-            define_variable(compiler, param_name);
+            if ((error = define_variable(compiler, param_name)) != 0)
+                return error;
         } while (consume_if(compiler, TOKEN_COMMA));
     }
 
-    compiler->context->function->name = object_string_new(function_name.start, function_name.length);
-
     if ((error = consume(compiler, TOKEN_RIGHT_PAREN)) != 0)
         return error;
     if ((error = consume(compiler, TOKEN_LEFT_BRACE)) != 0)
@@ -145,13 +211,50 @@ static compiler_error_t function_declaration(compiler_t *compiler)
         return error;
 
     compiler->context = context->enclosing;
-    object_function_t *function = compiler_context_destroy(context);
-    program_write(executing_program(compiler), OP_CONSTANT, OBJECT_VAL(function));
-    define_variable(compiler, function_name);
+    compiler_context_destroy(context);
 
     return error;
 }
 
+// Only finds where the body ends by matching braces, it's compiled on the first call.
+// A body using the consts of the functions or blocks around it is compiled now, they
+// are gone by then.
+static compiler_error_t function_skip(compiler_t *compiler, object_function_t *function)
+{
+    compiler_error_t error;
+    bool scoped_consts = false;
+
+    function->source = curr_token(compiler).start;
+    function->source_line = curr_token(compiler).line;
+
+    if ((error = consume(compiler, TOKEN_LEFT_PAREN)) != 0)
+        return error;
+
+    while (!consume_if(compiler, TOKEN_LEFT_BRACE))
+    {
+        if (curr_token(compiler).type == TOKEN_EOF)
+            return consume(compiler, TOKEN_LEFT_BRACE);
+        advance(compiler);
+    }
+
+    for (size_t depth = 1; depth > 0; advance(compiler))
+    {
+        switch (curr_token(compiler).type)
+        {
+            case TOKEN_LEFT_BRACE:  { depth++; } break;
+            case TOKEN_RIGHT_BRACE: { depth--; } break;
+            case TOKEN_IDENTIFIER:  { scoped_consts = scoped_consts || is_scoped_const(compiler, curr_token(compiler)); } break;
+            case TOKEN_EOF:         { return consume(compiler, TOKEN_RIGHT_BRACE); }
+            default: {}
+        }
+    }
+
+    if (scoped_consts)
+        return function_compile(compiler->context, function, &compiler->options);
+
+    return COMPILER_ERROR_NONE;
+}
+
 static compiler_error_t var_declaration(compiler_t *compiler)
 {
     compiler_error_t error;
@@ -171,9 +274,64 @@ static compiler_error_t var_declaration(compiler_t *compiler)
     if ((error = consume(compiler, TOKEN_SEMICOLON)) != 0)
         return error;
 
-    define_variable(compiler, var);
+    return define_variable(compiler, var);
+}
 
-    return error;
+// The initializer has to fold to a value, which replaces every use of the const
+static compiler_error_t const_declaration(compiler_t *compiler)
+{
+    compiler_error_t error;
+    if ((error = consume(compiler, TOKEN_IDENTIFIER)) != 0)
+        return error;
+
+    token_t name = prev_token(compiler);
+
+    if ((error = consume(compiler, TOKEN_EQUAL)) != 0)
+        return error;
+
+    size_t start = executing_program(compiler)->chunks.count;
+    if ((error = expression(compiler, PREC_ASSIGNMENT)) != 0)
+        return error;
+
+    value_t value;
+    size_t end = start;
+    if (!read_constant(executing_program(compiler), &end, &value) || end != executing_program(compiler)->chunks.count)
+    {
+        compiler_error(compiler, "Const '%.*s' must be initialized with a constant expression", (int)name.length, name.start);
+        return COMPILER_ERROR_CONSTANT_EXPECTED;
+    }
+
+    if ((error = consume(compiler, TOKEN_SEMICOLON)) != 0)
+        return error;
+
+    // Global consts are defined at runtime too, for the code compiled without seeing
+    // the declaration (lazy function bodies and the next lines of the REPL)
+    if (is_global_scope(compiler))
+    {
+        if ((error = define_variable(compiler, name)) != 0)
+            return error;
+    }
+    else
+        discard(compiler, start);
+
+    return add_local(compiler, name, &value);
+}
+
+// Binds the name to the module, which is only loaded once one of its members is used
+static compiler_error_t import_declaration(compiler_t *compiler)
+{
+    compiler_error_t error;
+    if ((error = consume(compiler, TOKEN_IDENTIFIER)) != 0)
+        return error;
+
+    token_t name = prev_token(compiler);
+
+    if ((error = consume(compiler, TOKEN_SEMICOLON)) != 0)
+        return error;
+
+    program_write(executing_program(compiler), OP_IMPORT, OBJECT_VAL(object_string_new(name.start, name.length)));
+
+    return define_variable(compiler, name);
 }
 
 static compiler_error_t statement(compiler_t *compiler)
@@ -202,6 +360,12 @@ static compiler_error_t statement(compiler_t *compiler)
     {
         error = statement_while(compiler);
     }
+    else if (consume_if(compiler, TOKEN_FOR))
+    {
+        begin_scope(compiler);
+            error = statement_for(compiler);
+        end_scope(compiler);
+    }
     else
     {
         error = statement_expression(compiler);
@@ -224,13 +388,16 @@ static compiler_error_t statement_if(compiler_t *compiler)
     if ((error = consume(compiler, TOKEN_RIGHT_PAREN)) != 0)
         return error;
 
+    // The condition is popped before either branch, so their locals get the right slots
     int if_jump = program_write(executing_program(compiler), OP_JUMP_IF_FALSE);
+    program_write(executing_program(compiler), OP_POP);
 
     if ((error = statement(compiler)) != 0)
         return error;
 
     int else_jump = program_write(executing_program(compiler), OP_JUMP);
     patch_jump(compiler, if_jump);
+    program_write(executing_program(compiler), OP_POP);
 
     if (consume_if(compiler, TOKEN_ELSE))
     {
@@ -238,7 +405,6 @@ static compiler_error_t statement_if(compiler_t *compiler)
             return error;
     }
     patch_jump(compiler, else_jump);
-    program_write(executing_program(compiler), OP_POP);
 
     return error;
 }
@@ -280,11 +446,11 @@ static compiler_error_t statement_while(compiler_t *compiler)
         return error;
 
     int while_jump = program_write(executing_program(compiler), OP_JUMP_IF_FALSE);
+    program_write(executing_program(compiler), OP_POP);
 
     if ((error = statement(compiler)) != 0)
         return error;
 
-    program_write(executing_program(compiler), OP_POP);
     int repeat_jump = program_write(executing_program(compiler), OP_JUMP);
     patch_jump_to(compiler, repeat_jump, condition_ptr);
 
@@ -294,6 +460,174 @@ static compiler_error_t statement_while(compiler_t *compiler)
     return error;
 }
 
+// for (initializer; condition; increment) statement, in its own scope. A loop of the
+// shape `i < limit; i = i + step` (or `<=`), with a number step and a limit that is a
+// local or a constant, ends with a single OP_LOOP_* instead of the increment, the
+// condition and the jumps around them
+static compiler_error_t statement_for(compiler_t *compiler)
+{
+    compiler_error_t error;
+
+    if ((error = consume(compiler, TOKEN_LEFT_PAREN)) != 0)
+        return error;
+
+    if (consume_if(compiler, TOKEN_VAR))
+        error = var_declaration(compiler);
+    else if (!consume_if(compiler, TOKEN_SEMICOLON))
+    {
+        error = statement_expression(compiler);
+        program_write(executing_program(compiler), OP_POP);
+    }
+    if (error != 0)
+        return error;
+
+    int loop_start = (int)executing_program(compiler)->chunks.count;
+    int exit_jump = -1;
+
+    size_t counter = 0;
+    op_code_t loop_op = OP_COUNT;
+    bool counted = false;
+
+    if (!consume_if(compiler, TOKEN_SEMICOLON))
+    {
+        if ((error = expression(compiler, PREC_ASSIGNMENT)) != 0)
+            return error;
+        if ((error = consume(compiler, TOKEN_SEMICOLON)) != 0)
+            return error;
+
+        counted = counted_loop_condition(compiler, (size_t)loop_start, &counter, &loop_op);
+        if (counted) // Rewritten to compare two locals
+            loop_start = (int)executing_program(compiler)->chunks.count - (loop_op == OP_LOOP_LESS ? 7 : 8);
+
+        exit_jump = program_write(executing_program(compiler), OP_JUMP_IF_FALSE);
+        program_write(executing_program(compiler), OP_POP);
+    }
+
+    value_t step = NIL_VAL;
+
+    if (!consume_if(compiler, TOKEN_RIGHT_PAREN))
+    {
+        int body_jump = program_write(executing_program(compiler), OP_JUMP);
+        int increment_start = (int)executing_program(compiler)->chunks.count;
+
+        if ((error = expression(compiler, PREC_ASSIGNMENT)) != 0)
+            return error;
+        if ((error = consume(compiler, TOKEN_RIGHT_PAREN)) != 0)
+            return error;
+
+        counted = counted && counted_loop_increment(compiler, (size_t)increment_start, counter, &step);
+        if (counted)
+            discard(compiler, (size_t)body_jump - 1);
+        else
+        {
+            program_write(executing_program(compiler), OP_POP);
+            int repeat_jump = program_write(executing_program(compiler), OP_JUMP);
+            patch_jump_to(compiler, repeat_jump, loop_start);
+
+            loop_start = increment_start;
+            patch_jump(compiler, body_jump);
+        }
+    }
+    else
+        counted = false;
+
+    int body_start = (int)executing_program(compiler)->chunks.count;
+
+    if ((error = statement(compiler)) != 0)
+        return error;
+
+    if (counted)
+    {
+        const program_t *program = executing_program(compiler);
+        const chunk *condition = &program->chunks.items[loop_start];
+        size_t limit = (size_t)((condition[4] << 8) | condition[5]);
+
+        int loop_jump = program_write(executing_program(compiler), loop_op, (int)counter, (int)limit, step);
+        if (loop_jump < 0)
+            return COMPILER_ERROR_OUT_OF_MEMORY;
+        patch_jump_to(compiler, loop_jump, body_start);
+
+        int end_jump = program_write(executing_program(compiler), OP_JUMP);
+        patch_jump(compiler, exit_jump);
+        program_write(executing_program(compiler), OP_POP);
+        patch_jump(compiler, end_jump);
+
+        return COMPILER_ERROR_NONE;
+    }
+
+    int repeat_jump = program_write(executing_program(compiler), OP_JUMP);
+    patch_jump_to(compiler, repeat_jump, loop_start);
+
+    if (exit_jump != -1)
+    {
+        patch_jump(compiler, exit_jump);
+        program_write(executing_program(compiler), OP_POP);
+    }
+
+    return COMPILER_ERROR_NONE;
+}
+
+// The condition is `counter < limit` or `counter <= limit` on locals, a constant limit
+// is moved to a hidden local declared right before the condition
+static bool counted_loop_condition(compiler_t *compiler, size_t start, size_t *counter, op_code_t *loop_op)
+{
+    program_t *program = executing_program(compiler);
+    const chunk *code = &program->chunks.items[start];
+    size_t length = program->chunks.count - start;
+
+    if (length < 5 || code[0] != OP_GET_LOCAL)
+        return false;
+
+    size_t limit_size = code[3] == OP_GET_LOCAL ? 3 : 2;
+    if (code[3] != OP_GET_LOCAL && !(code[3] == OP_CONSTANT && IS_NUMBER(program->constants.items[code[4]])))
+        return false;
+
+    const chunk *compare = &code[3 + limit_size];
+    if (length == 3 + limit_size + 1 && compare[0] == OP_GREATER)
+        *loop_op = OP_LOOP_LESS;
+    else if (length == 3 + limit_size + 2 && compare[0] == OP_LESS && compare[1] == OP_NOT)
+        *loop_op = OP_LOOP_LESS_EQUAL;
+    else
+        return false;
+
+    *counter = (size_t)((code[1] << 8) | code[2]);
+    if (code[3] == OP_GET_LOCAL)
+        return true;
+
+    if (compiler->context->locals.slots >= CLOX_LOCALS_MAX)
+        return false;
+
+    value_t limit = program->constants.items[code[4]];
+    discard(compiler, start);
+    program_write(program, OP_CONSTANT, limit);
+    add_local(compiler, (token_t){.type = TOKEN_IDENTIFIER, .start = " limit", .length = 6}, NULL);
+
+    program_write(program, OP_GET_LOCAL, (int)*counter);
+    program_write(program, OP_GET_LOCAL, (int)compiler->context->locals.slots - 1);
+    program_write(program, *loop_op == OP_LOOP_LESS ? OP_GREATER : OP_LESS);
+    if (*loop_op == OP_LOOP_LESS_EQUAL)
+        program_write(program, OP_NOT);
+
+    return true;
+}
+
+// The increment is `counter = counter + step` with a number step
+static bool counted_loop_increment(compiler_t *compiler, size_t start, size_t counter, value_t *step)
+{
+    const program_t *program = executing_program(compiler);
+    const chunk *code = &program->chunks.items[start];
+
+    if (program->chunks.count - start != 9 ||
+        code[0] != OP_GET_LOCAL || (size_t)((code[1] << 8) | code[2]) != counter ||
+        code[3] != OP_CONSTANT || !IS_NUMBER(program->constants.items[code[4]]) ||
+        code[5] != OP_ADD ||
+        code[6] != OP_SET_LOCAL || (size_t)((code[7] << 8) | code[8]) != counter)
+        return false;
+
+    *step = program->constants.items[code[4]];
+    return true;
+}
+
 static compiler_error_t statement_expression(compiler_t *compiler)
 {
     compiler_error_t error;
@@ -329,6 +663,7 @@ static compiler_error_t block(compiler_t *compiler)
 static compiler_error_t expression(compiler_t *compiler, precedence_t precedence)
 {
     compiler_error_t error;
+    size_t start = executing_program(compiler)->chunks.count;
 
     advance(compiler);
     parse_fn prefix = rules[prev_token(compiler).type].prefix;
@@ -347,6 +682,7 @@ static compiler_error_t expression(compiler_t *compiler, precedence_t precedence
     while (precedence <= rules[curr_token(compiler).type].precedence)
     {
         advance(compiler);
+        compiler->context->operand_start = start;
         if ((error = rules[prev_token(compiler).type].infix(compiler, can_assign)) != 0)
             goto out;
     }
@@ -366,7 +702,19 @@ static compiler_error_t variable(compiler_t *compiler, bool can_assign)
     compiler_error_t error;
     token_t var = prev_token(compiler);
 
-    int local_index = get_local(compiler, var);
+    compiler_local_t *local = resolve_local(compiler, var);
+    if (local != NULL && local->constant)
+    {
+        if (can_assign && curr_token(compiler).type == TOKEN_EQUAL)
+        {
+            compiler_error(compiler, "Can't assign to const '%.*s'", (int)var.length, var.start);
+            return COMPILER_ERROR_INVALID_ASSIGNMENT;
+        }
+
+        return emit_value(compiler, local->value);
+    }
+
+    int local_index = local != NULL ? (int)local->slot : -1;
 
     if (can_assign && consume_if(compiler, TOKEN_EQUAL))
     {
@@ -380,7 +728,7 @@ static compiler_error_t variable(compiler_t *compiler, bool can_assign)
         else
             program_write(executing_program(compiler),
                           OP_SET_LOCAL,
-                          NUMBER_VAL(local_index));
+                          local_index);
     }
     else
     {
@@ -391,7 +739,7 @@ static compiler_error_t variable(compiler_t *compiler, bool can_assign)
         else
             program_write(executing_program(compiler),
                           OP_GET_LOCAL,
-                          NUMBER_VAL(local_index));
+                          local_index);
     }
 
     return COMPILER_ERROR_NONE;
@@ -401,6 +749,7 @@ static compiler_error_t binary(compiler_t *compiler, UNUSED bool can_assign)
 {
     compiler_error_t error;
     token_type_t op = prev_token(compiler).type;
+    size_t start = compiler->context->operand_start;
 
     rule_t rule = rules[op];
     if ((error = expression(compiler, rule.precedence + 1)) != 0)
@@ -423,12 +772,12 @@ static compiler_error_t binary(compiler_t *compiler, UNUSED bool can_assign)
             } break;
         case TOKEN_GREATER_EQUAL:
             {
-                program_write(executing_program(compiler), OP_GREATER);
+                program_write(executing_program(compiler), OP_LESS);
                 program_write(executing_program(compiler), OP_NOT);
             } break;
         case TOKEN_LESS_EQUAL:
             {
-                program_write(executing_program(compiler), OP_LESS);
+                program_write(executing_program(compiler), OP_GREATER);
                 program_write(executing_program(compiler), OP_NOT);
             } break;
 
@@ -436,6 +785,7 @@ static compiler_error_t binary(compiler_t *compiler, UNUSED bool can_assign)
             UNREACHABLE;
     }
 
+    fold(compiler, start);
     return COMPILER_ERROR_NONE;
 }
 
@@ -443,6 +793,7 @@ static compiler_error_t unary(compiler_t *compiler, UNUSED bool can_assign)
 {
     compiler_error_t error;
     token_type_t op = prev_token(compiler).type;
+    size_t start = executing_program(compiler)->chunks.count;
 
     if ((error = expression(compiler, PREC_UNARY)) != 0)
         return error;
@@ -455,6 +806,7 @@ static compiler_error_t unary(compiler_t *compiler, UNUSED bool can_assign)
             UNREACHABLE;
     }
 
+    fold(compiler, start);
     return COMPILER_ERROR_NONE;
 }
 
@@ -517,9 +869,9 @@ static compiler_error_t call(compiler_t *compiler, UNUSED bool can_assign)
     {
         do
         {
-            if (compiler->context->function->arity++ > CLOX_LOCALS_MAX)
+            if (args_count >= UINT8_MAX)
             {
-                compiler_error(compiler, "Can't have more than %d parameters.", CLOX_LOCALS_MAX);
+                compiler_error(compiler, "Can't have more than %d arguments.", UINT8_MAX);
                 return COMPILER_ERROR_UNEXPECTED_TOKEN;
             }
 
@@ -537,15 +889,28 @@ static compiler_error_t call(compiler_t *compiler, UNUSED bool can_assign)
     return error;
 }
 
+// Members can only be read, assigning one is left to the invalid assignment check
+static compiler_error_t dot(compiler_t *compiler, UNUSED bool can_assign)
+{
+    compiler_error_t error;
+    if ((error = consume(compiler, TOKEN_IDENTIFIER)) != 0)
+        return error;
+
+    token_t name = prev_token(compiler);
+    program_write(executing_program(compiler), OP_GET_MEMBER, OBJECT_VAL(object_string_new(name.start, name.length)));
+
+    return COMPILER_ERROR_NONE;
+}
+
 static compiler_error_t and_(compiler_t *compiler, UNUSED bool can_assign)
 {
     compiler_error_t error = COMPILER_ERROR_NONE;
     int jump = program_write(executing_program(compiler), OP_JUMP_IF_FALSE);
+    program_write(executing_program(compiler), OP_POP);
 
     if ((error = expression(compiler, PREC_ASSIGNMENT)) != 0)
         return error;
 
-    program_write(executing_program(compiler), OP_POP);
     patch_jump(compiler, jump);
 
     return error;
@@ -578,10 +943,18 @@ static inline token_t prev_token(compiler_t *compiler)
     return compiler->tokenizer_context.prev;
 }
 
+static token_t next_token(tokenizer_context_t *context)
+{
+    if (context->stream != NULL)
+        return token_stream_get(context->stream, context->next++);
+
+    return tokenizer_next(context->tokenizer);
+}
+
 static void advance(compiler_t *compiler)
 {
     compiler->tokenizer_context.prev = curr_token(compiler);
-    compiler->tokenizer_context.curr = tokenizer_next(compiler->tokenizer_context.tokenizer);
+    compiler->tokenizer_context.curr = next_token(&compiler->tokenizer_context);
 }
 
 static bool consume_if(compiler_t *compiler, const token_type_t type)
@@ -625,35 +998,249 @@ static bool is_global_scope(compiler_t *compiler)
     return compiler->context->locals.depth == 0;
 }
 
-static void add_local(compiler_t *compiler, token_t var)
+static void rehash_locals(arena_t *arena, compiler_locals_t *locals, size_t buckets_count)
+{
+    locals->buckets = (int *)arena_allocate(arena, buckets_count * sizeof(int));
+    locals->buckets_count = buckets_count;
+
+    for (size_t i = 0; i < buckets_count; ++i)
+        locals->buckets[i] = -1;
+
+    for (size_t i = 0; i < locals->count; ++i)
+    {
+        compiler_local_t *local = &locals->items[i];
+        size_t bucket = local->hash & (buckets_count - 1);
+        local->next = locals->buckets[bucket];
+        locals->buckets[bucket] = (int)i;
+    }
+}
+
+// Consts are added with their value
+static compiler_error_t add_local(compiler_t *compiler, token_t var, const value_t *constant)
 {
     compiler_locals_t *locals = &compiler->context->locals;
-    locals->items[locals->count++] = (compiler_local_t){var, locals->depth};
+
+    if (constant == NULL && locals->slots >= CLOX_LOCALS_MAX)
+    {
+        compiler_error(compiler, "Can't have more than %d local variables in a function.", CLOX_LOCALS_MAX);
+        return COMPILER_ERROR_TOO_MANY_LOCALS;
+    }
+
+    if (locals->count >= locals->capacity)
+    {
+        compiler_local_t *old_items = locals->items;
+        locals->capacity = GROW_CAPACITY(locals->capacity);
+        locals->items = (compiler_local_t *)arena_allocate(&compiler->arena, locals->capacity * sizeof(compiler_local_t));
+        if (old_items != NULL)
+            memcpy(locals->items, old_items, locals->count * sizeof(compiler_local_t));
+    }
+
+    // Keeps the load factor at most 1, buckets count stays a power of 2
+    if (locals->count >= locals->buckets_count)
+        rehash_locals(&compiler->arena, locals, GROW_CAPACITY(locals->buckets_count));
+
+    uint32_t hash = tokenizer_token_hash(var);
+    size_t bucket = hash & (locals->buckets_count - 1);
+
+    locals->items[locals->count] = (compiler_local_t){
+        .name = var.start,
+        .length = var.length,
+        .hash = hash,
+        .depth = locals->depth,
+        .slot = constant == NULL ? locals->slots++ : 0,
+        .constant = constant != NULL,
+        .value = constant != NULL ? *constant : NIL_VAL,
+        .next = locals->buckets[bucket]};
+    locals->buckets[bucket] = (int)locals->count++;
+
+    return COMPILER_ERROR_NONE;
+}
+
+static compiler_local_t *get_local(compiler_locals_t *locals, token_t var)
+{
+    if (locals->count == 0)
+        return NULL;
+
+    uint32_t hash = tokenizer_token_hash(var);
+    for (int i = locals->buckets[hash & (locals->buckets_count - 1)]; i != -1; i = locals->items[i].next)
+    {
+        compiler_local_t *local = &locals->items[i];
+        if (local->hash == hash && local->length == var.length && memcmp(local->name, var.start, var.length) == 0)
+            return local;
+    }
+
+    return NULL;
 }
 
-static int get_local(compiler_t *compiler, token_t var)
+// The consts of the enclosing functions are visible, their variables are not
+static compiler_local_t *resolve_local(compiler_t *compiler, token_t var)
 {
-    for (int i = (int)compiler->context->locals.count - 1; i >= 0; --i)
-        if (tokenizer_token_cmp(compiler->context->locals.items[i].token, var))
-            return i;
+    compiler_local_t *local = get_local(&compiler->context->locals, var);
+    if (local != NULL)
+        return local;
+
+    for (compiler_context_t *context = compiler->context->enclosing; context != NULL; context = context->enclosing)
+    {
+        if ((local = get_local(&context->locals, var)) != NULL)
+            return local->constant ? local : NULL;
+    }
+
+    return NULL;
+}
 
-    return -1;
+// Global consts are the ones at depth 0, the only ones lazy bodies still see
+static bool is_scoped_const(compiler_t *compiler, token_t var)
+{
+    const compiler_local_t *local = resolve_local(compiler, var);
+    return local != NULL && local->constant && local->depth > 0;
 }
 
-static void define_variable(compiler_t *compiler, token_t token)
+static compiler_error_t define_variable(compiler_t *compiler, token_t token)
 {
     if (is_global_scope(compiler))
+    {
+        compiler_local_t *local = get_local(&compiler->context->locals, token);
+        if (local != NULL && local->constant)
+        {
+            compiler_error(compiler, "Const '%.*s' is already defined", (int)token.length, token.start);
+            return COMPILER_ERROR_INVALID_ASSIGNMENT;
+        }
+
         program_write(executing_program(compiler), OP_DEFINE_GLOBAL, OBJECT_VAL(object_string_new(token.start, token.length)));
-    else
-        add_local(compiler, token);
+        return COMPILER_ERROR_NONE;
+    }
+
+    return add_local(compiler, token, NULL);
 }
 
+// Locals are removed in reverse order of declaration, so the removed local is always
+// the head of its bucket
 static void remove_local(compiler_t *compiler)
 {
-    compiler->context->locals.count--;
+    compiler_locals_t *locals = &compiler->context->locals;
+    compiler_local_t *local = &locals->items[--locals->count];
+    locals->buckets[local->hash & (locals->buckets_count - 1)] = local->next;
+
+    if (local->constant)
+        return;
+
+    locals->slots--;
     program_write(executing_program(compiler), OP_POP);
 }
 
+static compiler_error_t emit_value(compiler_t *compiler, value_t value)
+{
+    int result;
+    switch (value.type)
+    {
+        case VAL_NIL:  { result = program_write(executing_program(compiler), OP_NIL); } break;
+        case VAL_BOOL: { result = program_write(executing_program(compiler), AS_BOOL(value) ? OP_TRUE : OP_FALSE); } break;
+        default:
+            {
+                result = program_write(executing_program(compiler), OP_CONSTANT, value);
+            } break;
+    }
+
+    return result < 0 ? COMPILER_ERROR_OUT_OF_MEMORY : COMPILER_ERROR_NONE;
+}
+
+// Reads the instruction at *offset if it pushes a constant
+static bool read_constant(const program_t *program, size_t *offset, value_t *value)
+{
+    switch (program->chunks.items[*offset])
+    {
+        case OP_NIL:   { *value = NIL_VAL; } break;
+        case OP_TRUE:  { *value = BOOL_VAL(true); } break;
+        case OP_FALSE: { *value = BOOL_VAL(false); } break;
+        case OP_CONSTANT:
+            {
+                *value = program->constants.items[program->chunks.items[*offset + 1]];
+                *offset += 1;
+            } break;
+        default:
+            return false;
+    }
+
+    *offset += 1;
+    return true;
+}
+
+// Removes the code emitted since start, along with the constants it added last. The
+// code can't be a jump target
+static void discard(compiler_t *compiler, size_t start)
+{
+    program_t *program = executing_program(compiler);
+    size_t first = program->constants.count;
+    size_t used = 0;
+
+    for (size_t i = start; i < program->chunks.count; i += 1 + (size_t)program_operand_size(program->chunks.items[i]))
+    {
+        if (program->chunks.items[i] != OP_CONSTANT)
+            continue;
+
+        size_t index = program->chunks.items[i + 1];
+        first = index < first ? index : first;
+        used++;
+    }
+
+    if (first + used == program->constants.count)
+        program->constants.count = first;
+    program->chunks.count = start;
+}
+
+// Replaces the code emitted since start by its value when all of its operands are
+// known, strings included: they're interned and never freed under the compiler.
+// Other objects (functions) are left alone
+static void fold(compiler_t *compiler, size_t start)
+{
+    program_t *program = executing_program(compiler);
+    value_t stack[2];
+    size_t top = 0;
+
+    for (size_t i = start; i < program->chunks.count; )
+    {
+        value_t value;
+        if (read_constant(program, &i, &value))
+        {
+            if (top == 2 || (IS_OBJECT(value) && !IS_STRING(value)))
+                return;
+            stack[top++] = value;
+            continue;
+        }
+
+        op_code_t op = program->chunks.items[i++];
+        switch (op)
+        {
+            case OP_NOT:
+            case OP_NEGATE:
+                {
+                    if (top < 1 || !program_fold(op, stack[top - 1], NIL_VAL, &stack[top - 1]))
+                        return;
+                } break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MULTI:
+            case OP_DIV:
+                {
+                    if (top < 2 || !program_fold(op, stack[top - 2], stack[top - 1], &stack[top - 2]))
+                        return;
+                    top--;
+                } break;
+            default:
+                return;
+        }
+    }
+
+    if (top != 1)
+        return;
+
+    discard(compiler, start);
+    emit_value(compiler, stack[0]);
+}
+
 static void patch_jump_to(compiler_t *compiler, int offset, int to)
 {
     executing_program(compiler)->chunks.items[offset + 0] = (chunk)((to >> 8) & 0xFF);
@@ -665,62 +1252,119 @@ static void patch_jump(compiler_t *compiler, int offset)
     patch_jump_to(compiler, offset, (int)executing_program(compiler)->chunks.count);
 }
 
-void compiler_init(compiler_t *compiler, tokenizer_t *tokenizer)
+// Tokens come from the stream when there is one, the tokenizer isn't used then
+void compiler_init(compiler_t *compiler, tokenizer_t *tokenizer, const token_stream_t *stream, const compiler_options_t *options)
 {
     compiler->tokenizer_context = (tokenizer_context_t){
         .tokenizer = tokenizer,
-        .curr = tokenizer_next(tokenizer)};
+        .stream = stream};
+    compiler->tokenizer_context.curr = next_token(&compiler->tokenizer_context);
 
-    compiler->context = compiler_context_new(NULL, CLOX_MAIN_FN);
+    compiler->options = options != NULL ? *options : (compiler_options_t){0};
+    compiler->context = NULL;
+    arena_init(&compiler->arena);
 }
 
+// The function is left to the collector
 void compiler_free(compiler_t *compiler)
 {
-    object_function_destroy(compiler_context_destroy(compiler->context));
+    arena_free(&compiler->arena);
+    compiler->context = NULL;
 }
 
 void compiler_error(compiler_t *compiler, const char *fmt, ...)
 {
-    (void) compiler;
-
     va_list args;
     va_start(args, fmt);
-    fprintf(stderr, "[COMPILER] ERROR: ");
+    fprintf(stderr, "[COMPILER] ERROR (line %zu): ", compiler->tokenizer_context.prev.line);
     vfprintf(stderr, fmt, args);
     va_end(args);
     fputc('\n', stderr);
 }
 
-compiler_error_t compiler_run(compiler_t *compiler, const char *source)
+compiler_error_t compiler_run(compiler_t *compiler, const char *source, const compiler_options_t *options)
 {
     tokenizer_t tokenizer;
     tokenizer_init(&tokenizer, source);
-    compiler_init(compiler, &tokenizer);
+    if (options != NULL && options->first_line > 0)
+        tokenizer.line = options->first_line;
 
-    compiler_error_t error;
+    // Too large a source is tokenized as it's parsed
+    token_stream_t stream = {0};
+    bool pretokenized = options != NULL && options->pretokenize && token_stream_build(&stream, &tokenizer, options->threads);
+
+    compiler_init(compiler, &tokenizer, pretokenized ? &stream : NULL, options);
+    compiler->context = compiler_context_new(&compiler->arena, NULL, object_function_new(CLOX_MAIN_FN, 0));
+
+    // Grows once or twice for most scripts instead of from 8 bytes, shrunk at the end
+    program_reserve(executing_program(compiler), strlen(source) / CLOX_SOURCE_PER_CHUNK, 0);
+
+    compiler_error_t error = COMPILER_ERROR_NONE;
 
     while (curr_token(compiler).type != TOKEN_EOF)
     {
         if ((error = declaration(compiler)) != 0)
-            return error;
+            goto out;
     }
 
     if ((error = consume(compiler, TOKEN_EOF)) != 0)
-        return error;
+        goto out;
 
     program_write(executing_program(compiler), OP_NIL);
     program_write(executing_program(compiler), OP_RETURN);
+    optimize(compiler, compiler->context->function);
+    shrink(compiler->context->function);
+
+out:
+    token_stream_free(&stream);
+    compiler->tokenizer_context.stream = NULL;
+
+    // Nothing is left to use on an error
+    if (error != COMPILER_ERROR_NONE)
+        compiler_free(compiler);
+
+    return error;
+}
+
+// Compiles a lazy function's body from its source, enclosed by the given context
+static compiler_error_t function_compile(compiler_context_t *enclosing, object_function_t *function,
+                                         const compiler_options_t *options)
+{
+    tokenizer_t tokenizer;
+    tokenizer_init(&tokenizer, function->source);
+    tokenizer.line = function->source_line;
+
+    compiler_t compiler;
+    compiler_init(&compiler, &tokenizer, NULL, options);
+    compiler.context = enclosing;
+
+    compiler_error_t error = function_body(&compiler, function);
+    compiler_free(&compiler);
+    if (error == 0)
+        function->source = NULL;
+
+    return error;
+}
+
+compiler_error_t compiler_run_function(object_function_t *function, const compiler_options_t *options)
+{
+    compiler_error_t error = function_compile(options->globals, function, options);
+    if (error != 0)
+        return error;
+
+    if (options->pipeline != NULL)
+        ir_optimize(function, options->pipeline);
+    shrink(function);
 
     return COMPILER_ERROR_NONE;
 }
 
-compiler_context_t *compiler_context_new(compiler_context_t *enclosing, const char *function_name)
+compiler_context_t *compiler_context_new(arena_t *arena, compiler_context_t *enclosing, object_function_t *function)
 {
-    compiler_context_t *context = NULL;
-    context = memory_allocate(context, sizeof(compiler_context_t), false);
+    compiler_context_t *context = (compiler_context_t *)arena_allocate(arena, sizeof(compiler_context_t));
     *context = (compiler_context_t){
         .enclosing = enclosing,
-        .function = object_function_new(function_name, 0),
+        .function = function,
         .locals = (compiler_locals_t){0}};
     
     return context;
@@ -733,6 +1377,5 @@ object_function_t *compiler_context_destroy(compiler_context_t *context)
     program_write(&function->program, OP_NIL);
     program_write(&function->program, OP_RETURN);
 
-    memory_free(context);
     return function;
 }
@@ -0,0 +1,378 @@
+#include "gc.h"
+
+#define GC_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+typedef struct gc_nursery
+{
+    uint8_t *data;
+    size_t used;
+} gc_nursery_t;
+
+typedef struct gc_remembered
+{
+    table_t **items;
+    size_t count;
+    size_t capacity;
+} gc_remembered_t;
+
+typedef struct gc_heap
+{
+    object_t *objects;
+    gc_nursery_t nursery;
+    gc_remembered_t remembered;
+    table_t strings; // Interned, keys only
+    gc_stats_t stats;
+} gc_heap_t;
+
+static gc_heap_t heap = {.objects = NULL, .stats = {.next = CLOX_GC_HEAP_MIN}};
+
+// What the object holds, the objects it refers to aside
+static size_t object_size(const object_t *object)
+{
+    switch (object->type)
+    {
+    case OBJECT_STRING:
+        {
+            const object_string_t *string = (const object_string_t *)object;
+            return STRING_SIZE(string->length);
+        }
+    case OBJECT_FUNCTION:
+        {
+            const object_function_t *function = (const object_function_t *)object;
+            return sizeof(object_function_t) + program_size(&function->program);
+        }
+    case OBJECT_NATIVE:
+        {
+            return sizeof(object_native_t);
+        }
+    case OBJECT_MODULE:
+        {
+            const object_module_t *module = (const object_module_t *)object;
+            return sizeof(object_module_t) + sizeof(table_t) + module->globals->capacity * sizeof(entry_t);
+        }
+    case OBJECT_BUILDER:
+        {
+            const object_builder_t *builder = (const object_builder_t *)object;
+            return sizeof(object_builder_t) + builder->capacity;
+        }
+    case OBJECT_ROPE:
+        {
+            return sizeof(object_rope_t);
+        }
+    default:
+        UNREACHABLE;
+    }
+
+    return 0;
+}
+
+static void gc_count(size_t bytes)
+{
+    heap.stats.bytes += bytes;
+    if (heap.stats.bytes > heap.stats.peak)
+        heap.stats.peak = heap.stats.bytes;
+}
+
+void gc_track(object_t *object, size_t bytes)
+{
+    object->marked = false;
+    object->young = false;
+    object->next = heap.objects;
+    heap.objects = object;
+
+    heap.stats.objects++;
+    heap.stats.allocated[object->type]++;
+    gc_count(bytes);
+}
+
+void gc_grow(size_t bytes)
+{
+    gc_count(bytes);
+}
+
+object_t *gc_allocate_young(object_type_t type, size_t size)
+{
+    size = GC_ALIGN(size);
+    if (heap.nursery.used + size > CLOX_GC_NURSERY_SIZE)
+        return NULL;
+
+    if (heap.nursery.data == NULL)
+        heap.nursery.data = (uint8_t *)memory_allocate(NULL, CLOX_GC_NURSERY_SIZE, false);
+
+    object_t *object = (object_t *)(heap.nursery.data + heap.nursery.used);
+    heap.nursery.used += size;
+
+    object->type = type;
+    object->marked = false;
+    object->young = true;
+    object->next = NULL;
+
+    heap.stats.young_objects++;
+    heap.stats.allocated[type]++;
+    return object;
+}
+
+// Collecting before the nursery is full keeps allocations out of the old space
+bool gc_pressure(void)
+{
+#if CLOX_GC_NURSERY_SIZE > 0
+    if (heap.nursery.used * 4 >= (size_t)CLOX_GC_NURSERY_SIZE * 3)
+        return true;
+#endif // CLOX_GC_NURSERY_SIZE
+
+    return gc_major_pressure();
+}
+
+bool gc_major_pressure(void)
+{
+    return CLOX_GC_STRESS || heap.stats.bytes >= heap.stats.next;
+}
+
+object_string_t *gc_intern_find(const char *data, size_t length, uint32_t hash, bool young)
+{
+    if (heap.strings.capacity == 0)
+        return NULL;
+
+    entry_t *entry = table_find_string(&heap.strings, data, length, hash);
+    if (entry == NULL)
+        return NULL;
+
+    // Forwarded now, the young references compare equal to the copy until they're patched
+    object_t *object = (object_t *)entry->key;
+    if (object->young && !young)
+    {
+        object->next = (object_t *)object_string_copy(entry->key);
+        object->marked = true;
+        heap.stats.promoted_objects++;
+        entry->key = (object_string_t *)object->next;
+    }
+
+    return entry->key;
+}
+
+// The set isn't an object, its entries are counted with the heap
+void gc_intern(object_string_t *string)
+{
+    size_t capacity = heap.strings.capacity;
+    if (capacity == 0)
+        table_init(&heap.strings);
+
+    table_entry_set(&heap.strings, string, NIL_VAL);
+    gc_count((heap.strings.capacity - capacity) * sizeof(entry_t));
+}
+
+void gc_remember(table_t *table)
+{
+    for (size_t i = 0; i < heap.remembered.count; ++i)
+    {
+        if (heap.remembered.items[i] == table)
+            return;
+    }
+
+    if (heap.remembered.count >= heap.remembered.capacity)
+    {
+        size_t capacity = GROW_CAPACITY(heap.remembered.capacity);
+        heap.remembered.items = (table_t **)memory_allocate(heap.remembered.items, capacity * sizeof(table_t *), false);
+        heap.remembered.capacity = capacity;
+    }
+
+    heap.remembered.items[heap.remembered.count++] = table;
+}
+
+// The first reference met copies the object and leaves the copy's address behind,
+// the others are patched with it
+void gc_promote(value_t *value)
+{
+    if (!IS_OBJECT(*value) || !AS_OBJECT(*value)->young)
+        return;
+
+    object_t *object = AS_OBJECT(*value);
+    if (!object->marked)
+    {
+        assert(object->type == OBJECT_STRING && "Only strings are allocated young");
+
+        const object_string_t *string = (const object_string_t *)object;
+        object->next = (object_t *)object_string_copy(string);
+        object->marked = true;
+        heap.stats.promoted_objects++;
+    }
+
+    *value = OBJECT_VAL(object->next);
+}
+
+void gc_minor(void)
+{
+    for (size_t i = 0; i < heap.remembered.count; ++i)
+    {
+        table_t *table = heap.remembered.items[i];
+        for (size_t j = 0; j < table->capacity; ++j)
+            gc_promote(&table->entries[j].value);
+    }
+
+    for (size_t i = 0; i < heap.strings.capacity; ++i)
+    {
+        entry_t *entry = &heap.strings.entries[i];
+        if (entry->key == NULL || !entry->key->object.young)
+            continue;
+
+        if (entry->key->object.marked)
+            entry->key = (object_string_t *)entry->key->object.next;
+        else
+            table_entry_delete(&heap.strings, entry->key);
+    }
+
+    heap.remembered.count = 0;
+    heap.nursery.used = 0;
+    heap.stats.minor_collections++;
+}
+
+// Recursion is bounded by how deep functions are nested in the source
+void gc_mark_object(object_t *object)
+{
+    if (object == NULL || object->marked)
+        return;
+
+    object->marked = true;
+    switch (object->type)
+    {
+    case OBJECT_STRING:
+    case OBJECT_NATIVE:
+    case OBJECT_BUILDER:
+        break;
+    case OBJECT_FUNCTION:
+        {
+            object_function_t *function = (object_function_t *)object;
+            gc_mark_object((object_t *)function->name);
+            for (size_t i = 0; i < function->program.constants.count; ++i)
+                gc_mark_value(function->program.constants.items[i]);
+        } break;
+    case OBJECT_MODULE:
+        {
+            object_module_t *module = (object_module_t *)object;
+            gc_mark_object((object_t *)module->name);
+            gc_mark_table(module->globals);
+        } break;
+    case OBJECT_ROPE:
+        {
+            object_rope_t *rope = (object_rope_t *)object;
+            gc_mark_object((object_t *)rope->builder);
+            gc_mark_object((object_t *)rope->flat);
+        } break;
+    default:
+        UNREACHABLE;
+    }
+}
+
+void gc_mark_value(value_t value)
+{
+    if (IS_OBJECT(value))
+        gc_mark_object(AS_OBJECT(value));
+}
+
+void gc_mark_table(const table_t *table)
+{
+    for (size_t i = 0; i < table->capacity; ++i)
+    {
+        gc_mark_object((object_t *)table->entries[i].key);
+        gc_mark_value(table->entries[i].value);
+    }
+}
+
+// Consts of a context are values the compiler may still write as constants
+void gc_mark_context(const compiler_context_t *context)
+{
+    for (; context != NULL; context = context->enclosing)
+    {
+        gc_mark_object((object_t *)context->function);
+        for (size_t i = 0; i < context->locals.count; ++i)
+            gc_mark_value(context->locals.items[i].value);
+    }
+}
+
+void gc_sweep(void)
+{
+    size_t freed_objects = 0;
+    size_t freed_bytes = 0;
+
+    for (size_t i = 0; i < heap.strings.capacity; ++i)
+    {
+        entry_t *entry = &heap.strings.entries[i];
+        if (entry->key != NULL && !entry->key->object.marked)
+            table_entry_delete(&heap.strings, entry->key);
+    }
+
+    size_t bytes = heap.strings.capacity * sizeof(entry_t);
+    object_t **link = &heap.objects;
+    while (*link != NULL)
+    {
+        object_t *object = *link;
+        if (object->marked)
+        {
+            object->marked = false;
+            bytes += object_size(object);
+            link = &object->next;
+            continue;
+        }
+
+        *link = object->next;
+        freed_objects++;
+        freed_bytes += object_size(object);
+        object_free(object);
+    }
+
+    heap.stats.collections++;
+    heap.stats.objects -= freed_objects;
+    heap.stats.freed_objects += freed_objects;
+    heap.stats.freed_bytes += freed_bytes;
+    heap.stats.bytes = bytes;
+
+    size_t next = bytes * CLOX_GC_GROWTH;
+    heap.stats.next = next > CLOX_GC_HEAP_MIN ? next : CLOX_GC_HEAP_MIN;
+}
+
+void gc_free(void)
+{
+    while (heap.objects != NULL)
+    {
+        object_t *object = heap.objects;
+        heap.objects = object->next;
+        object_free(object);
+    }
+
+    memory_free(heap.nursery.data);
+    memory_free(heap.remembered.items);
+    table_free(&heap.strings);
+    heap.nursery = (gc_nursery_t){0};
+    heap.remembered = (gc_remembered_t){0};
+
+    heap.stats.objects = 0;
+    heap.stats.bytes = 0;
+}
+
+const gc_stats_t *gc_stats(void)
+{
+    return &heap.stats;
+}
+
+void gc_census(size_t objects[OBJECT_COUNT], size_t bytes[OBJECT_COUNT])
+{
+    for (size_t type = 0; type < OBJECT_COUNT; ++type)
+        objects[type] = bytes[type] = 0;
+
+    for (const object_t *object = heap.objects; object != NULL; object = object->next)
+    {
+        objects[object->type]++;
+        bytes[object->type] += object_size(object);
+    }
+}
+
+void gc_stats_print(void)
+{
+    const gc_stats_t *stats = &heap.stats;
+    fprintf(stderr, "[GC] minor collections: %zu\n", stats->minor_collections);
+    fprintf(stderr, "[GC] young: %zu objects, %zu promoted\n", stats->young_objects, stats->promoted_objects);
+    fprintf(stderr, "[GC] collections: %zu\n", stats->collections);
+    fprintf(stderr, "[GC] live: %zu objects, %zu bytes (peak %zu)\n", stats->objects, stats->bytes, stats->peak);
+    fprintf(stderr, "[GC] freed: %zu objects, %zu bytes\n", stats->freed_objects, stats->freed_bytes);
+    fprintf(stderr, "[GC] next collection at %zu bytes\n", stats->next);
+}
@@ -0,0 +1,638 @@
+#define _DEFAULT_SOURCE // getpid
+#include <unistd.h>
+#include "image.h"
+#include "memory.h"
+#include "source.h"
+#include "gc.h"
+
+typedef enum image_tag
+{
+    IMAGE_TAG_NIL,
+    IMAGE_TAG_FALSE,
+    IMAGE_TAG_TRUE,
+    IMAGE_TAG_NUMBER,
+    IMAGE_TAG_OBJECT,   // Index of an object written before
+
+    IMAGE_TAG_STRING,   // Object records
+    IMAGE_TAG_FUNCTION,
+    IMAGE_TAG_END,      // After the last object record
+
+    IMAGE_TAG_COUNT
+} image_tag_t;
+
+typedef struct image_slot
+{
+    const object_t *object;
+    uint32_t index;
+} image_slot_t;
+
+typedef struct image_writer
+{
+    image_buffer_t *buffer;
+    image_slot_t *slots; // Objects written so far, open addressing
+    size_t capacity;
+    uint32_t count;
+} image_writer_t;
+
+typedef struct image_reader
+{
+    const uint8_t *current;
+    const uint8_t *end;
+    object_t **objects;  // Objects read so far, by index
+    size_t count;
+    size_t capacity;
+    bool failed;
+} image_reader_t;
+
+static void write_bytes(image_buffer_t *, const void *, size_t);
+static void write_u8(image_buffer_t *, uint8_t);
+static void write_u32(image_buffer_t *, uint32_t);
+static image_slot_t *writer_slot(image_writer_t *, const object_t *);
+static bool write_object(image_writer_t *, const object_t *);
+static void write_value(image_writer_t *, value_t);
+static bool write_objects(image_writer_t *, value_t);
+static size_t write_header(image_buffer_t *, image_kind_t, uint64_t);
+static void write_end(image_buffer_t *, size_t);
+
+static const uint8_t *read_bytes(image_reader_t *, size_t);
+static uint8_t read_u8(image_reader_t *);
+static uint32_t read_u32(image_reader_t *);
+static void read_object(image_reader_t *, image_tag_t);
+static bool read_verify(object_function_t *);
+static value_t read_value(image_reader_t *);
+static bool read_header(image_reader_t *, const void *, size_t, image_kind_t, uint64_t);
+static void reader_free(image_reader_t *);
+
+static void write_bytes(image_buffer_t *buffer, const void *bytes, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = GROW_CAPACITY(buffer->capacity);
+        while (capacity < buffer->length + length)
+            capacity = GROW_CAPACITY(capacity);
+
+        buffer->data = (uint8_t *)memory_allocate(buffer->data, capacity, false);
+        buffer->capacity = capacity;
+    }
+
+    if (length > 0)
+        memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void write_u8(image_buffer_t *buffer, uint8_t value)
+{
+    write_bytes(buffer, &value, sizeof(value));
+}
+
+static void write_u32(image_buffer_t *buffer, uint32_t value)
+{
+    write_bytes(buffer, &value, sizeof(value));
+}
+
+static image_slot_t *writer_slot(image_writer_t *writer, const object_t *object)
+{
+    if ((writer->count + 1) * 2 > writer->capacity)
+    {
+        image_slot_t *slots = writer->slots;
+        size_t capacity = writer->capacity;
+
+        writer->capacity = GROW_CAPACITY(capacity);
+        writer->slots = (image_slot_t *)memory_allocate(NULL, writer->capacity * sizeof(image_slot_t), true);
+
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            if (slots[i].object != NULL)
+                *writer_slot(writer, slots[i].object) = slots[i];
+        }
+
+        memory_free(slots);
+    }
+
+    size_t i = ((uintptr_t)object >> 4) & (writer->capacity - 1);
+    while (writer->slots[i].object != NULL && writer->slots[i].object != object)
+        i = (i + 1) & (writer->capacity - 1);
+
+    return &writer->slots[i];
+}
+
+// Objects an object refers to are written before it
+static bool write_object(image_writer_t *writer, const object_t *object)
+{
+    image_slot_t *slot = writer_slot(writer, object);
+    if (slot->object != NULL)
+        return true;
+
+    image_buffer_t *buffer = writer->buffer;
+
+    switch (object->type)
+    {
+    case OBJECT_STRING:
+        {
+            const object_string_t *string = (const object_string_t *)object;
+            write_u8(buffer, IMAGE_TAG_STRING);
+            write_u32(buffer, (uint32_t)string->length);
+            write_bytes(buffer, string->data, string->length);
+        } break;
+    case OBJECT_ROPE:
+        {
+            // Read back flattened
+            const object_rope_t *rope = (const object_rope_t *)object;
+            write_u8(buffer, IMAGE_TAG_STRING);
+            write_u32(buffer, (uint32_t)rope->length);
+            write_bytes(buffer, rope->builder->data, rope->length);
+        } break;
+    case OBJECT_FUNCTION:
+        {
+            const object_function_t *function = (const object_function_t *)object;
+            const program_t *program = &function->program;
+            // Read back functions are bound to the script's namespace
+            if (function->source != NULL || function->globals != NULL)
+                return false;
+
+            for (size_t i = 0; i < program->constants.count; ++i)
+            {
+                if (!write_objects(writer, program->constants.items[i]))
+                    return false;
+            }
+
+            write_u8(buffer, IMAGE_TAG_FUNCTION);
+            write_u32(buffer, (uint32_t)function->name->length);
+            write_bytes(buffer, function->name->data, function->name->length);
+            write_u32(buffer, (uint32_t)function->arity);
+            write_u32(buffer, (uint32_t)program->chunks.count);
+            write_bytes(buffer, program->chunks.items, program->chunks.count);
+            write_u32(buffer, (uint32_t)program->constants.count);
+
+            for (size_t i = 0; i < program->constants.count; ++i)
+                write_value(writer, program->constants.items[i]);
+        } break;
+    default:
+        return false;
+    }
+
+    // Writing the constants may have moved the slot
+    slot = writer_slot(writer, object);
+    *slot = (image_slot_t){.object = object, .index = writer->count++};
+
+    return true;
+}
+
+// The objects must have been written already
+static void write_value(image_writer_t *writer, value_t value)
+{
+    switch (value.type)
+    {
+    case VAL_NIL:
+        {
+            write_u8(writer->buffer, IMAGE_TAG_NIL);
+        } break;
+    case VAL_BOOL:
+        {
+            write_u8(writer->buffer, AS_BOOL(value) ? IMAGE_TAG_TRUE : IMAGE_TAG_FALSE);
+        } break;
+    case VAL_NUMBER:
+        {
+            double number = AS_NUMBER(value);
+            write_u8(writer->buffer, IMAGE_TAG_NUMBER);
+            write_bytes(writer->buffer, &number, sizeof(number));
+        } break;
+    case VAL_OBJECT:
+        {
+            write_u8(writer->buffer, IMAGE_TAG_OBJECT);
+            write_u32(writer->buffer, writer_slot(writer, AS_OBJECT(value))->index);
+        } break;
+    default:
+        UNREACHABLE;
+    }
+}
+
+static bool write_objects(image_writer_t *writer, value_t value)
+{
+    return !IS_OBJECT(value) || write_object(writer, AS_OBJECT(value));
+}
+
+static size_t write_header(image_buffer_t *buffer, image_kind_t kind, uint64_t key)
+{
+    image_header_t header = {
+        .magic = CLOX_IMAGE_MAGIC,
+        .version = CLOX_IMAGE_VERSION,
+        .op_count = OP_COUNT,
+        .kind = (uint32_t)kind,
+        .key = key};
+
+    size_t start = buffer->length;
+    write_bytes(buffer, &header, sizeof(header));
+
+    return start;
+}
+
+static void write_end(image_buffer_t *buffer, size_t start)
+{
+    image_header_t header;
+    memcpy(&header, buffer->data + start, sizeof(header));
+
+    header.length = buffer->length - start - sizeof(header);
+    header.checksum = image_hash(buffer->data + start + sizeof(header), header.length, 0);
+    memcpy(buffer->data + start, &header, sizeof(header));
+}
+
+static const uint8_t *read_bytes(image_reader_t *reader, size_t length)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < length)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->current;
+    reader->current += length;
+    return bytes;
+}
+
+static uint8_t read_u8(image_reader_t *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, sizeof(uint8_t));
+    return bytes != NULL ? *bytes : 0;
+}
+
+static uint32_t read_u32(image_reader_t *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static void read_object(image_reader_t *reader, image_tag_t tag)
+{
+    object_t *object = NULL;
+
+    switch (tag)
+    {
+    case IMAGE_TAG_STRING:
+        {
+            uint32_t length = read_u32(reader);
+            const uint8_t *data = read_bytes(reader, length);
+            if (data == NULL)
+                return;
+
+            object = (object_t *)object_string_new((const char *)data, length);
+        } break;
+    case IMAGE_TAG_FUNCTION:
+        {
+            uint32_t name_length = read_u32(reader);
+            const uint8_t *name = read_bytes(reader, name_length);
+            uint32_t arity = read_u32(reader);
+            uint32_t code_length = read_u32(reader);
+            const uint8_t *code = read_bytes(reader, code_length);
+            uint32_t constants_count = read_u32(reader);
+
+            // Every constant takes a byte at least
+            if (reader->failed || constants_count > (size_t)(reader->end - reader->current))
+            {
+                reader->failed = true;
+                return;
+            }
+
+            object_function_t *function = (object_function_t *)object_new(OBJECT_FUNCTION, sizeof(object_function_t));
+            function->name = object_string_new((const char *)name, name_length);
+            function->arity = arity;
+            function->source = NULL;
+            function->source_line = 0;
+            function->globals = NULL;
+
+            // Sized exactly, these arrays are never written to again
+            program_t *program = &function->program;
+            program_init(program);
+            program_reserve(program, code_length, constants_count);
+            chunk_array_append(&program->chunks, code, code_length);
+            gc_grow(program_size(program));
+
+            for (size_t i = 0; i < constants_count && !reader->failed; ++i)
+                value_array_write(&program->constants, read_value(reader));
+
+            if (!reader->failed && !read_verify(function))
+                reader->failed = true;
+
+            if (reader->failed)
+                return;
+
+            object = (object_t *)function;
+        } break;
+    default:
+        {
+            reader->failed = true;
+        } return;
+    }
+
+    if (reader->count >= reader->capacity)
+    {
+        reader->capacity = GROW_CAPACITY(reader->capacity);
+        reader->objects = (object_t **)memory_allocate(reader->objects, reader->capacity * sizeof(object_t *), false);
+    }
+
+    reader->objects[reader->count++] = object;
+}
+
+// The VM trusts operands. The IR builder checks that every instruction fits, jumps
+// onto an instruction of the function and uses constants that exist, its analysis that
+// slots and calls stay within the stack and that paths meet at the same height. Names
+// must be strings and the code can't run off its end.
+static bool read_verify(object_function_t *function)
+{
+    ir_function_t ir;
+    bool ok = ir_build(&ir, function) && ir_analyze(&ir);
+
+    for (size_t i = 0; ok && i < ir.count; ++i)
+    {
+        switch (ir.instructions[i].op)
+        {
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_IMPORT:
+        case OP_GET_MEMBER:
+            {
+                ok = IS_STRING(ir.instructions[i].constant);
+            } break;
+        default: {}
+        }
+    }
+
+    ok = ok && (ir.instructions[ir.count - 1].op == OP_RETURN || ir.instructions[ir.count - 1].op == OP_JUMP);
+
+    ir_free(&ir);
+    return ok;
+}
+
+static value_t read_value(image_reader_t *reader)
+{
+    switch ((image_tag_t)read_u8(reader))
+    {
+    case IMAGE_TAG_NIL:   { return NIL_VAL; }
+    case IMAGE_TAG_FALSE: { return BOOL_VAL(false); }
+    case IMAGE_TAG_TRUE:  { return BOOL_VAL(true); }
+    case IMAGE_TAG_NUMBER:
+        {
+            double number = 0;
+            const uint8_t *bytes = read_bytes(reader, sizeof(number));
+            if (bytes != NULL)
+                memcpy(&number, bytes, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+    case IMAGE_TAG_OBJECT:
+        {
+            uint32_t index = read_u32(reader);
+            if (reader->failed || index >= reader->count)
+                break;
+            return OBJECT_VAL(reader->objects[index]);
+        }
+    default:
+        break;
+    }
+
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+// Checks the header and reads the object records, the roots follow them
+static bool read_header(image_reader_t *reader, const void *data, size_t length, image_kind_t kind, uint64_t key)
+{
+    *reader = (image_reader_t){0};
+
+    image_header_t header;
+    if (length < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, CLOX_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CLOX_IMAGE_VERSION || header.op_count != OP_COUNT ||
+        header.kind != (uint32_t)kind || header.key != key || header.length != length - sizeof(header))
+        return false;
+
+    reader->current = (const uint8_t *)data + sizeof(header);
+    reader->end = (const uint8_t *)data + length;
+
+    if (header.checksum != image_hash(reader->current, header.length, 0))
+        return false;
+
+    image_tag_t tag;
+    while (!reader->failed && (tag = (image_tag_t)read_u8(reader)) != IMAGE_TAG_END)
+        read_object(reader, tag);
+
+    return !reader->failed;
+}
+
+// Objects of a rejected image are unreachable, the collector frees them
+static void reader_free(image_reader_t *reader)
+{
+    memory_free(reader->objects);
+    *reader = (image_reader_t){0};
+}
+
+// FNV-1a
+uint64_t image_hash(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = seed != 0 ? seed : 14695981039346656037u;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+void image_buffer_free(image_buffer_t *buffer)
+{
+    memory_free(buffer->data);
+    *buffer = (image_buffer_t){0};
+}
+
+bool image_write(image_buffer_t *buffer, const object_function_t *function, uint64_t key)
+{
+    image_writer_t writer = {.buffer = buffer};
+    size_t start = write_header(buffer, IMAGE_KIND_FUNCTION, key);
+
+    const object_t *root = (const object_t *)function;
+
+    bool written = write_object(&writer, root);
+    if (written)
+    {
+        write_u8(buffer, IMAGE_TAG_END);
+        write_u8(buffer, IMAGE_TAG_OBJECT);
+        write_u32(buffer, writer_slot(&writer, root)->index);
+        write_end(buffer, start);
+    }
+
+    memory_free(writer.slots);
+    return written;
+}
+
+object_function_t *image_read(const void *data, size_t length, uint64_t key)
+{
+    image_reader_t reader;
+    object_function_t *function = NULL;
+
+    if (read_header(&reader, data, length, IMAGE_KIND_FUNCTION, key))
+    {
+        value_t root = read_value(&reader);
+        if (!IS_FUNCTION(root) || reader.current != reader.end)
+            reader.failed = true;
+        else
+            function = AS_FUNCTION(root);
+    }
+
+    reader_free(&reader);
+    return function;
+}
+
+bool image_write_heap(image_buffer_t *buffer, const table_t *globals, uint64_t key)
+{
+    image_writer_t writer = {.buffer = buffer};
+    size_t start = write_header(buffer, IMAGE_KIND_HEAP, key);
+    uint32_t count = 0;
+    bool written = true;
+
+    for (size_t i = 0; written && i < globals->capacity; ++i)
+    {
+        const entry_t *entry = &globals->entries[i];
+        if (entry->key == NULL || IS_NATIVE(entry->value) || IS_MODULE(entry->value) || IS_BUILDER(entry->value))
+            continue;
+
+        written = write_objects(&writer, OBJECT_VAL(entry->key)) && write_objects(&writer, entry->value);
+        count++;
+    }
+
+    if (written)
+    {
+        write_u8(buffer, IMAGE_TAG_END);
+        write_u32(buffer, count);
+
+        for (size_t i = 0; i < globals->capacity; ++i)
+        {
+            const entry_t *entry = &globals->entries[i];
+            if (entry->key == NULL || IS_NATIVE(entry->value) || IS_MODULE(entry->value) || IS_BUILDER(entry->value))
+                continue;
+
+            write_value(&writer, OBJECT_VAL(entry->key));
+            write_value(&writer, entry->value);
+        }
+
+        write_end(buffer, start);
+    }
+
+    memory_free(writer.slots);
+    return written;
+}
+
+bool image_read_heap(const void *data, size_t length, uint64_t key, table_t *globals)
+{
+    image_reader_t reader;
+    if (!read_header(&reader, data, length, IMAGE_KIND_HEAP, key))
+    {
+        reader_free(&reader);
+        return false;
+    }
+
+    // Checked whole before the table is touched
+    uint32_t count = read_u32(&reader);
+    const uint8_t *roots = reader.current;
+    for (uint32_t i = 0; i < count && !reader.failed; ++i)
+    {
+        value_t name = read_value(&reader);
+        read_value(&reader);
+        reader.failed = reader.failed || !IS_STRING(name);
+    }
+
+    if (reader.failed || reader.current != reader.end)
+    {
+        reader.failed = true;
+        reader_free(&reader);
+        return false;
+    }
+
+    reader.current = roots;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        value_t name = read_value(&reader);
+        table_entry_set(globals, AS_STRING(name), read_value(&reader));
+    }
+
+    reader_free(&reader);
+    return true;
+}
+
+bool image_save(const char *path, const image_buffer_t *buffer)
+{
+    size_t length = strlen(path);
+    char *temporary = (char *)memory_allocate(NULL, length + 32, false);
+    snprintf(temporary, length + 32, "%s.%ld.tmp", path, (long)getpid());
+
+    bool saved = false;
+    FILE *file = fopen(temporary, "wb");
+    if (file != NULL)
+    {
+        saved = fwrite(buffer->data, 1, buffer->length, file) == buffer->length;
+        saved = fclose(file) == 0 && saved;
+        saved = saved && rename(temporary, path) == 0;
+
+        if (!saved)
+            remove(temporary);
+    }
+
+    memory_free(temporary);
+    return saved;
+}
+
+uint64_t image_cache_key(const char *source, size_t length, const ir_pipeline_t *pipeline)
+{
+    uint64_t key = image_hash(CLOX_VERSION, sizeof(CLOX_VERSION) - 1, 0);
+
+    for (size_t i = 0; pipeline != NULL && i < pipeline->count; ++i)
+        key = image_hash(pipeline->passes[i]->name, strlen(pipeline->passes[i]->name) + 1, key);
+
+    return image_hash(source, length, key);
+}
+
+char *image_cache_path(const char *script)
+{
+    size_t length = strlen(script);
+    size_t extension = sizeof(CLOX_IMAGE_EXTENSION) - 1;
+
+    // script.lox gets script.loxc, anything else gets the extension appended
+    if (length > 4 && strcmp(script + length - 4, ".lox") == 0)
+        length -= 4;
+
+    char *path = (char *)memory_allocate(NULL, length + extension + 1, false);
+    memcpy(path, script, length);
+    memcpy(path + length, CLOX_IMAGE_EXTENSION, extension + 1);
+
+    return path;
+}
+
+object_function_t *image_cache_load(const char *path, uint64_t key)
+{
+    source_t image;
+    if (source_open(&image, path) != 0)
+        return NULL;
+
+    object_function_t *function = image_read(image.data, image.length, key);
+    source_close(&image);
+
+    return function;
+}
+
+bool image_cache_save(const char *path, const object_function_t *function, uint64_t key)
+{
+    image_buffer_t buffer = {0};
+
+    bool saved = image_write(&buffer, function, key) && image_save(path, &buffer);
+
+    image_buffer_free(&buffer);
+    return saved;
+}
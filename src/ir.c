@@ -0,0 +1,1274 @@
+#include "ir.h"
+
+typedef struct ir_slot
+{
+    int def;
+    int value; // Number of the value, the instruction that made it or an entry slot
+    ir_lattice_t lattice;
+} ir_slot_t;
+
+#define LATTICE_UNKNOWN      ((ir_lattice_t){IR_LATTICE_UNKNOWN, NIL_VAL})
+#define LATTICE_CONSTANT(v)  ((ir_lattice_t){IR_LATTICE_CONSTANT, (v)})
+
+#define ENTRY_VALUE(slot)    (IR_INPUT - 1 - (int)(slot)) // Value a slot holds at block entry
+
+static bool pass_inline(ir_function_t *);
+static bool pass_propagate(ir_function_t *);
+static bool pass_cse(ir_function_t *);
+static bool pass_copy(ir_function_t *);
+static bool pass_fold(ir_function_t *);
+static bool pass_branch(ir_function_t *);
+static bool pass_dce(ir_function_t *);
+
+static const ir_pass_t passes[] =
+{
+    {"inline",    pass_inline},
+    {"propagate", pass_propagate},
+    {"cse",       pass_cse},
+    {"copy",      pass_copy},
+    {"fold",      pass_fold},
+    {"branch",    pass_branch},
+    {"dce",       pass_dce},
+};
+
+static const char *default_pipeline[] = {"inline", "propagate", "cse", "copy", "fold", "branch", "dce"};
+
+static bool is_loop(const op_code_t op)
+{
+    return op == OP_LOOP_LESS || op == OP_LOOP_LESS_EQUAL;
+}
+
+// Instructions whose operand is a target
+static bool is_jump(const op_code_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || is_loop(op);
+}
+
+static bool is_terminator(const op_code_t op)
+{
+    return is_jump(op) || op == OP_RETURN;
+}
+
+static bool refers_to_slot(const ir_instruction_t *instruction, const size_t slot)
+{
+    if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL)
+        return instruction->operand == slot;
+    if (is_loop(instruction->op))
+        return instruction->slots[0] == slot || instruction->slots[1] == slot;
+    return false;
+}
+
+// Slots above `position` move by `delta`
+static void move_slots(ir_instruction_t *instruction, const size_t position, const int delta)
+{
+    if ((instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL) && instruction->operand > position)
+        instruction->operand = (size_t)((int)instruction->operand + delta);
+
+    if (is_loop(instruction->op))
+        for (size_t k = 0; k < 2; ++k)
+            if (instruction->slots[k] > position)
+                instruction->slots[k] = (size_t)((int)instruction->slots[k] + delta);
+}
+
+// Pure instructions that push a value without consuming any
+static bool is_leaf(const ir_instruction_t *instruction)
+{
+    switch (instruction->op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+        return !instruction->dead;
+    default:
+        return false;
+    }
+}
+
+// Operands of the instructions that only compute a value from them, 0 for the others
+static size_t pure_arity(const op_code_t op)
+{
+    switch (op)
+    {
+    case OP_NOT:
+    case OP_NEGATE:
+        return 1;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MULTI:
+    case OP_DIV:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static size_t block_of(const ir_function_t *ir, const size_t index)
+{
+    size_t low = 0, high = ir->blocks_count;
+    while (high - low > 1)
+    {
+        size_t mid = (low + high) / 2;
+        if (ir->blocks[mid].start <= index)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static bool lattice_same(const ir_lattice_t a, const ir_lattice_t b)
+{
+    if (a.kind != b.kind)
+        return false;
+    if (a.kind != IR_LATTICE_CONSTANT)
+        return true;
+    if (a.value.type != b.value.type)
+        return false;
+
+    switch (a.value.type)
+    {
+    case VAL_NIL:    return true;
+    case VAL_BOOL:   return AS_BOOL(a.value) == AS_BOOL(b.value);
+    case VAL_NUMBER: return memcmp(&AS_NUMBER(a.value), &AS_NUMBER(b.value), sizeof(double)) == 0;
+    case VAL_OBJECT: return AS_OBJECT(a.value) == AS_OBJECT(b.value);
+    default:         return false;
+    }
+}
+
+static ir_lattice_t lattice_meet(const ir_lattice_t a, const ir_lattice_t b)
+{
+    if (a.kind == IR_LATTICE_UNDEFINED)
+        return b;
+    if (b.kind == IR_LATTICE_UNDEFINED)
+        return a;
+
+    return lattice_same(a, b) ? a : LATTICE_UNKNOWN;
+}
+
+// Strings are known too, they're interned and the VM never frees them under the
+// program, so they can be duplicated and folded. Functions aren't tracked
+static ir_lattice_t lattice_of(const value_t value)
+{
+    return IS_OBJECT(value) && !IS_STRING(value) ? LATTICE_UNKNOWN : LATTICE_CONSTANT(value);
+}
+
+// Mirrors vm_run, gives up on anything that would be a runtime error
+static ir_lattice_t evaluate(const op_code_t op, const ir_lattice_t left, const ir_lattice_t right)
+{
+    if (left.kind != IR_LATTICE_CONSTANT)
+        return LATTICE_UNKNOWN;
+    if (op != OP_NOT && op != OP_NEGATE && right.kind != IR_LATTICE_CONSTANT)
+        return LATTICE_UNKNOWN;
+
+    value_t result;
+    if (!program_fold(op, left.value, right.value, &result))
+        return LATTICE_UNKNOWN;
+
+    return LATTICE_CONSTANT(result);
+}
+
+static void make_constant(ir_instruction_t *instruction, const value_t value)
+{
+    switch (value.type)
+    {
+    case VAL_NIL:  { instruction->op = OP_NIL; } break;
+    case VAL_BOOL: { instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE; } break;
+    default:
+        {
+            instruction->op = OP_CONSTANT;
+            instruction->constant = value;
+        }
+    }
+
+    instruction->operand = 0;
+    instruction->args[0] = IR_INPUT;
+    instruction->args[1] = IR_INPUT;
+}
+
+// Operands pushed by pure instructions read by nothing else, they can be dropped
+static bool removable_operands(const ir_function_t *ir, const ir_instruction_t *instruction, const size_t arity)
+{
+    for (size_t k = 0; k < arity; ++k)
+    {
+        int arg = instruction->args[k];
+        if (arg == IR_INPUT || !is_leaf(&ir->instructions[arg]) || ir->instructions[arg].uses != 1)
+            return false;
+    }
+
+    return true;
+}
+
+// Removes an instruction that pushed a value, slots above it move down until `end`
+static void remove_push(ir_function_t *ir, const size_t index, const size_t end)
+{
+    size_t position = ir->instructions[index].height;
+    ir->instructions[index].dead = true;
+
+    for (size_t i = index + 1; i < end; ++i)
+        move_slots(&ir->instructions[i], position, -1);
+}
+
+static size_t successors(const ir_function_t *ir, const size_t b, size_t out[2])
+{
+    const ir_block_t *block = &ir->blocks[b];
+    const ir_instruction_t *last = NULL;
+
+    for (size_t i = block->end; i > block->start; --i)
+    {
+        if (!ir->instructions[i - 1].dead)
+        {
+            last = &ir->instructions[i - 1];
+            break;
+        }
+    }
+
+    size_t count = 0;
+    if (last == NULL || !is_terminator(last->op) || last->op == OP_JUMP_IF_FALSE || is_loop(last->op))
+    {
+        if (b + 1 < ir->blocks_count)
+            out[count++] = b + 1;
+    }
+
+    if (last != NULL && is_jump(last->op))
+        out[count++] = block_of(ir, last->operand);
+
+    return count;
+}
+
+static bool same_value(const ir_function_t *ir, const int a, const int b)
+{
+    if (a == b)
+        return true;
+    if (a < 0 || b < 0)
+        return false;
+
+    const ir_lattice_t left = ir->instructions[a].result, right = ir->instructions[b].result;
+    return left.kind == IR_LATTICE_CONSTANT && lattice_same(left, right);
+}
+
+// Lowest slot under `top` holding the result of an instruction like this one, made
+// earlier in the block from the same values
+static size_t find_available(const ir_function_t *ir, const ir_slot_t *stack, const size_t top,
+                             const ir_instruction_t *instruction)
+{
+    const size_t arity = pure_arity(instruction->op);
+
+    for (size_t t = 0; t < top; ++t)
+    {
+        if (stack[t].value < 0)
+            continue;
+
+        const ir_instruction_t *other = &ir->instructions[stack[t].value];
+        if (other->op != instruction->op || other->dead)
+            continue;
+
+        bool same = true;
+        for (size_t k = 0; k < arity && same; ++k)
+            same = same_value(ir, other->values[k], instruction->values[k]);
+
+        if (same)
+            return t;
+    }
+
+    return SIZE_MAX;
+}
+
+// Runs the block on an abstract stack, (re)computing the links and value numbers of
+// its instructions
+static bool simulate(ir_function_t *ir, const ir_block_t *block, ir_slot_t *stack, size_t *height)
+{
+    size_t top = block->height;
+    for (size_t i = 0; i < top; ++i)
+        stack[i] = (ir_slot_t){IR_INPUT, ENTRY_VALUE(i), block->entry[i]};
+
+#define PUSH_VALUE(d, v, l)                           \
+    do                                                \
+    {                                                 \
+        if (top >= CLOX_VALUE_STACK_MAX)              \
+            return false;                             \
+        stack[top++] = (ir_slot_t){(d), (v), (l)};    \
+    } while (0)
+#define PUSH(d, l) PUSH_VALUE(d, d, l)
+#define USE(slot)                                 \
+    do                                            \
+    {                                             \
+        if ((slot).def != IR_INPUT)               \
+            ir->instructions[(slot).def].uses++;  \
+    } while (0)
+#define POP(slot)                                 \
+    do                                            \
+    {                                             \
+        if (top == 0)                             \
+            return false;                         \
+        slot = stack[--top];                      \
+        USE(slot);                                \
+    } while (0)
+
+    for (size_t i = block->start; i < block->end; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        instruction->uses = 0;
+        instruction->args[0] = IR_INPUT;
+        instruction->args[1] = IR_INPUT;
+        instruction->values[0] = IR_INPUT;
+        instruction->values[1] = IR_INPUT;
+        instruction->result = LATTICE_UNKNOWN;
+        instruction->height = top;
+        instruction->available = SIZE_MAX;
+
+        if (instruction->dead)
+            continue;
+
+        int def = (int)i;
+        ir_slot_t a, b;
+
+        switch (instruction->op)
+        {
+        case OP_CONSTANT:
+            {
+                instruction->result = lattice_of(instruction->constant);
+                PUSH(def, instruction->result);
+            } break;
+        case OP_NIL:   { instruction->result = LATTICE_CONSTANT(NIL_VAL); PUSH(def, instruction->result); } break;
+        case OP_TRUE:  { instruction->result = LATTICE_CONSTANT(BOOL_VAL(true)); PUSH(def, instruction->result); } break;
+        case OP_FALSE: { instruction->result = LATTICE_CONSTANT(BOOL_VAL(false)); PUSH(def, instruction->result); } break;
+        case OP_GET_GLOBAL:
+        case OP_IMPORT: { PUSH(def, LATTICE_UNKNOWN); } break;
+        case OP_GET_MEMBER:
+            {
+                POP(a);
+                instruction->args[0] = a.def;
+                PUSH(def, LATTICE_UNKNOWN);
+            } break;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_RETURN:
+            {
+                POP(a);
+                instruction->args[0] = a.def;
+            } break;
+
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+            {
+                if (top == 0)
+                    return false;
+                USE(stack[top - 1]);
+                instruction->args[0] = stack[top - 1].def;
+                instruction->result = stack[top - 1].lattice;
+            } break;
+
+        case OP_GET_LOCAL:
+            {
+                if (instruction->operand >= top)
+                    return false;
+                USE(stack[instruction->operand]);
+                instruction->result = stack[instruction->operand].lattice;
+                instruction->values[0] = stack[instruction->operand].value;
+
+                for (size_t t = 0; t < instruction->operand && instruction->available == SIZE_MAX; ++t)
+                    if (stack[t].value == instruction->values[0])
+                        instruction->available = t;
+
+                PUSH_VALUE(def, instruction->values[0], instruction->result);
+            } break;
+        case OP_SET_LOCAL:
+            {
+                if (top == 0 || instruction->operand >= top)
+                    return false;
+                USE(stack[top - 1]);
+                USE(stack[instruction->operand]);
+                instruction->args[0] = stack[top - 1].def;
+                stack[instruction->operand] = stack[top - 1];
+            } break;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MULTI:
+        case OP_DIV:
+            {
+                POP(b);
+                POP(a);
+                instruction->args[0] = a.def;
+                instruction->args[1] = b.def;
+                instruction->values[0] = a.value;
+                instruction->values[1] = b.value;
+                instruction->result = evaluate(instruction->op, a.lattice, b.lattice);
+                instruction->available = find_available(ir, stack, top, instruction);
+                PUSH(def, instruction->result);
+            } break;
+        case OP_NOT:
+        case OP_NEGATE:
+            {
+                POP(a);
+                instruction->args[0] = a.def;
+                instruction->values[0] = a.value;
+                instruction->result = evaluate(instruction->op, a.lattice, LATTICE_UNKNOWN);
+                instruction->available = find_available(ir, stack, top, instruction);
+                PUSH(def, instruction->result);
+            } break;
+
+        case OP_LOOP_LESS:
+        case OP_LOOP_LESS_EQUAL:
+            {
+                if (instruction->slots[0] >= top || instruction->slots[1] >= top)
+                    return false;
+                USE(stack[instruction->slots[0]]);
+                USE(stack[instruction->slots[1]]);
+                instruction->args[0] = stack[instruction->slots[0]].def;
+                instruction->args[1] = stack[instruction->slots[1]].def;
+                stack[instruction->slots[0]] = (ir_slot_t){def, def, LATTICE_UNKNOWN};
+            } break;
+
+        case OP_CALL:
+            {
+                if (top <= instruction->operand)
+                    return false;
+                instruction->args[0] = stack[top - instruction->operand - 1].def;
+                for (size_t k = 0; k <= instruction->operand; ++k)
+                    POP(a);
+                PUSH(def, LATTICE_UNKNOWN);
+            } break;
+
+        case OP_JUMP: break;
+        default:
+            return false;
+        }
+    }
+
+#undef POP
+#undef USE
+#undef PUSH
+#undef PUSH_VALUE
+
+    *height = top;
+    return true;
+}
+
+// Blocks start at jump targets and after terminators
+static void split_blocks(ir_function_t *ir)
+{
+    for (size_t b = 0; b < ir->blocks_count; ++b)
+        memory_free(ir->blocks[b].entry);
+    memory_free(ir->blocks);
+
+    bool *leaders = (bool *)memory_allocate(NULL, ir->count + 1, true);
+    leaders[0] = true;
+
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        const ir_instruction_t *instruction = &ir->instructions[i];
+        if (is_jump(instruction->op))
+            leaders[instruction->operand] = true;
+
+        if (is_terminator(instruction->op))
+            leaders[i + 1] = true;
+    }
+
+    ir->blocks_count = 0;
+    for (size_t i = 0; i < ir->count; ++i)
+        ir->blocks_count += leaders[i];
+
+    ir->blocks = (ir_block_t *)memory_allocate(NULL, ir->blocks_count * sizeof(ir_block_t), true);
+    for (size_t i = 0, b = 0; i < ir->count; ++i)
+    {
+        if (!leaders[i])
+            continue;
+
+        if (b > 0)
+            ir->blocks[b - 1].end = i;
+        ir->blocks[b++].start = i;
+    }
+    ir->blocks[ir->blocks_count - 1].end = ir->count;
+
+    memory_free(leaders);
+}
+
+static bool merge(ir_block_t *block, const ir_slot_t *stack, const size_t height, bool *changed)
+{
+    if (!block->reachable)
+    {
+        block->reachable = true;
+        block->height = height;
+        block->entry = (ir_lattice_t *)memory_allocate(NULL, (height + 1) * sizeof(ir_lattice_t), false);
+        for (size_t i = 0; i < height; ++i)
+            block->entry[i] = stack[i].lattice;
+
+        *changed = true;
+        return true;
+    }
+
+    if (block->height != height)
+        return false;
+
+    for (size_t i = 0; i < height; ++i)
+    {
+        ir_lattice_t meet = lattice_meet(block->entry[i], stack[i].lattice);
+        if (!lattice_same(meet, block->entry[i]))
+        {
+            block->entry[i] = meet;
+            *changed = true;
+        }
+    }
+
+    return true;
+}
+
+bool ir_build(ir_function_t *ir, object_function_t *function)
+{
+    const program_t *program = &function->program;
+    const size_t length = program->chunks.count;
+
+    *ir = (ir_function_t){.function = function};
+    if (length == 0)
+        return false;
+
+    bool ok = true;
+    int *index_of = (int *)memory_allocate(NULL, (length + 1) * sizeof(int), false);
+    ir->instructions = (ir_instruction_t *)memory_allocate(NULL, length * sizeof(ir_instruction_t), true);
+
+    for (size_t offset = 0; offset <= length; ++offset)
+        index_of[offset] = -1;
+
+    for (size_t offset = 0; offset < length;)
+    {
+        const chunk *code = &program->chunks.items[offset];
+        int size = program_operand_size(code[0]);
+        if (size < 0 || offset + (size_t)size >= length)
+        {
+            ok = false;
+            goto out;
+        }
+
+        index_of[offset] = (int)ir->count;
+        ir_instruction_t *instruction = &ir->instructions[ir->count++];
+        *instruction = (ir_instruction_t){
+            .op = (op_code_t)code[0],
+            .constant = NIL_VAL,
+            .args = {IR_INPUT, IR_INPUT}};
+
+        switch (code[0])
+        {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_IMPORT:
+        case OP_GET_MEMBER:
+            {
+                if (code[1] >= program->constants.count)
+                {
+                    ok = false;
+                    goto out;
+                }
+                instruction->constant = program->constants.items[code[1]];
+            } break;
+        case OP_CALL: { instruction->operand = code[1]; } break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            {
+                instruction->operand = (size_t)((code[1] << 8) | code[2]);
+            } break;
+        case OP_LOOP_LESS:
+        case OP_LOOP_LESS_EQUAL:
+            {
+                if (code[5] >= program->constants.count)
+                {
+                    ok = false;
+                    goto out;
+                }
+                instruction->slots[0] = (size_t)((code[1] << 8) | code[2]);
+                instruction->slots[1] = (size_t)((code[3] << 8) | code[4]);
+                instruction->constant = program->constants.items[code[5]];
+                instruction->operand = (size_t)((code[6] << 8) | code[7]);
+            } break;
+        default: {}
+        }
+
+        offset += 1 + (size_t)size;
+    }
+
+    // Jump targets become instruction indices
+    for (size_t i = 0; i < ir->count && ok; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (!is_jump(instruction->op))
+            continue;
+
+        if (instruction->operand >= length || index_of[instruction->operand] < 0)
+            ok = false;
+        else
+            instruction->operand = (size_t)index_of[instruction->operand];
+    }
+
+    if (ok)
+        split_blocks(ir);
+
+out:
+    memory_free(index_of);
+    return ok;
+}
+
+bool ir_analyze(ir_function_t *ir)
+{
+    for (size_t b = 0; b < ir->blocks_count; ++b)
+    {
+        memory_free(ir->blocks[b].entry);
+        ir->blocks[b].entry = NULL;
+        ir->blocks[b].reachable = false;
+        ir->blocks[b].height = 0;
+    }
+
+    size_t height = ir->function->arity;
+    if (height > CLOX_VALUE_STACK_MAX)
+        return false;
+
+    // Blocks meet at the same height, so an instruction pushes a slot at most once
+    ir_slot_t *stack = (ir_slot_t *)memory_allocate(NULL, (height + ir->count + 1) * sizeof(ir_slot_t), false);
+    for (size_t i = 0; i < height; ++i)
+        stack[i] = (ir_slot_t){IR_INPUT, ENTRY_VALUE(i), LATTICE_UNKNOWN};
+
+    bool changed = false;
+    bool ok = merge(&ir->blocks[0], stack, height, &changed);
+
+    while (ok && changed)
+    {
+        changed = false;
+        for (size_t b = 0; b < ir->blocks_count && ok; ++b)
+        {
+            if (!ir->blocks[b].reachable)
+                continue;
+
+            if (!(ok = simulate(ir, &ir->blocks[b], stack, &height)))
+                break;
+
+            size_t next[2];
+            size_t count = successors(ir, b, next);
+            for (size_t s = 0; s < count && ok; ++s)
+                ok = merge(&ir->blocks[next[s]], stack, height, &changed);
+        }
+    }
+
+    memory_free(stack);
+    return ok;
+}
+
+bool ir_lower(ir_function_t *ir, program_t *program)
+{
+    bool ok = true;
+    size_t *offsets = (size_t *)memory_allocate(NULL, (ir->count + 1) * sizeof(size_t), false);
+    int *patches = (int *)memory_allocate(NULL, ir->count * sizeof(int), false);
+
+    // Sized like the original, passes mostly remove instructions
+    program_init(program);
+    program_reserve(program, ir->function->program.chunks.count, ir->function->program.constants.count);
+
+    for (size_t b = 0; b < ir->blocks_count && ok; ++b)
+    {
+        const ir_block_t *block = &ir->blocks[b];
+        for (size_t i = block->start; i < block->end && ok; ++i)
+        {
+            const ir_instruction_t *instruction = &ir->instructions[i];
+            offsets[i] = program->chunks.count;
+            patches[i] = -1;
+
+            if (instruction->dead || !block->reachable)
+                continue;
+
+            switch (instruction->op)
+            {
+            case OP_CONSTANT:
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_IMPORT:
+            case OP_GET_MEMBER:
+                {
+                    ok = program_write(program, instruction->op, instruction->constant) >= 0;
+                } break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_CALL:
+                {
+                    program_write(program, instruction->op, (int)instruction->operand);
+                } break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                {
+                    patches[i] = program_write(program, instruction->op);
+                } break;
+            case OP_LOOP_LESS:
+            case OP_LOOP_LESS_EQUAL:
+                {
+                    patches[i] = program_write(program, instruction->op,
+                                               (int)instruction->slots[0], (int)instruction->slots[1], instruction->constant);
+                    ok = patches[i] >= 0;
+                } break;
+            default:
+                program_write(program, instruction->op);
+            }
+        }
+    }
+    offsets[ir->count] = program->chunks.count;
+
+    for (size_t i = 0; i < ir->count && ok; ++i)
+    {
+        if (patches[i] < 0)
+            continue;
+
+        size_t to = offsets[ir->instructions[i].operand];
+        program->chunks.items[patches[i] + 0] = (chunk)((to >> 8) & 0xFF);
+        program->chunks.items[patches[i] + 1] = (chunk)((to >> 0) & 0xFF);
+    }
+
+    if (!ok)
+        program_free(program);
+
+    memory_free(patches);
+    memory_free(offsets);
+    return ok;
+}
+
+void ir_free(ir_function_t *ir)
+{
+    for (size_t b = 0; b < ir->blocks_count; ++b)
+        memory_free(ir->blocks[b].entry);
+
+    memory_free(ir->blocks);
+    memory_free(ir->instructions);
+    *ir = (ir_function_t){0};
+}
+
+void ir_print(const ir_function_t *ir)
+{
+    printf("\n=== IR %.*s ===\n", (int)ir->function->name->length, ir->function->name->data);
+
+    for (size_t b = 0; b < ir->blocks_count; ++b)
+    {
+        const ir_block_t *block = &ir->blocks[b];
+        printf("b%zu:%s\n", b, block->reachable ? "" : " (unreachable)");
+
+        for (size_t i = block->start; i < block->end; ++i)
+        {
+            const ir_instruction_t *instruction = &ir->instructions[i];
+            if (instruction->dead)
+                continue;
+
+            printf("  v%zu = op%d", i, instruction->op);
+            for (size_t k = 0; k < 2; ++k)
+                if (instruction->args[k] != IR_INPUT)
+                    printf(" v%d", instruction->args[k]);
+            if (is_jump(instruction->op))
+                printf(" -> b%zu", block_of(ir, instruction->operand));
+            if (instruction->result.kind == IR_LATTICE_CONSTANT)
+            {
+                printf("\t; ");
+                value_print(instruction->result.value);
+            }
+            printf("\n");
+        }
+    }
+}
+
+static const ir_inline_body_t *inline_body(const ir_function_t *ir, const size_t call)
+{
+    const ir_instruction_t *instruction = &ir->instructions[call];
+    if (ir->unit == NULL || instruction->op != OP_CALL || instruction->dead ||
+        instruction->args[0] == IR_INPUT || !ir->blocks[block_of(ir, call)].reachable)
+        return NULL;
+
+    const ir_instruction_t *callee = &ir->instructions[instruction->args[0]];
+    if (callee->op != OP_GET_GLOBAL || callee->dead || !IS_STRING(callee->constant))
+        return NULL;
+
+    for (size_t i = 0; i < ir->unit->inlinable_count; ++i)
+    {
+        const ir_inline_body_t *body = &ir->unit->inlinable[i];
+        if (body->function->arity != instruction->operand ||
+            !object_string_cmp(body->function->name, AS_STRING(callee->constant)))
+            continue;
+
+        // A function can only run once the main function has made it, calls in one made
+        // before the definition stay runtime errors
+        if (ir->function != ir->unit->main)
+        {
+            for (size_t f = 0; f < ir->unit->functions_count; ++f)
+                if (ir->unit->functions[f] == ir->function)
+                    return body->defined < ir->unit->created[f] ? body : NULL;
+
+            return NULL;
+        }
+
+        // So do calls in the main function that run before the definition
+        for (size_t d = 0; d < call; ++d)
+            if (ir->instructions[d].op == OP_DEFINE_GLOBAL && !ir->instructions[d].dead &&
+                object_string_cmp(body->function->name, AS_STRING(ir->instructions[d].constant)))
+                return body;
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+// Calls to small top-level functions, the arguments become the callee's parameters
+// in place and the result is moved down to where the callee was
+static bool pass_inline(ir_function_t *ir)
+{
+    size_t capacity = ir->count;
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        const ir_inline_body_t *body = inline_body(ir, i);
+        if (body != NULL)
+            capacity += body->count + body->height + 1;
+    }
+
+    if (capacity == ir->count)
+        return true;
+
+    ir_instruction_t *instructions = (ir_instruction_t *)memory_allocate(NULL, capacity * sizeof(ir_instruction_t), false);
+    size_t *map = (size_t *)memory_allocate(NULL, (ir->count + 1) * sizeof(size_t), false);
+    size_t count = 0;
+
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        map[i] = count;
+
+        const ir_inline_body_t *body = inline_body(ir, i);
+        if (body == NULL)
+        {
+            instructions[count++] = ir->instructions[i];
+            continue;
+        }
+
+        size_t callee = map[ir->instructions[i].args[0]];
+        size_t base = ir->instructions[ir->instructions[i].args[0]].height;
+
+        // Nothing between the callee and the call refers to its slot, slots above move down
+        bool movable = true;
+        for (size_t k = callee + 1; k < count && movable; ++k)
+            if (refers_to_slot(&instructions[k], base))
+                movable = false;
+
+        if (!movable)
+        {
+            instructions[count++] = ir->instructions[i];
+            continue;
+        }
+
+        instructions[callee].dead = true;
+        for (size_t k = callee + 1; k < count; ++k)
+            move_slots(&instructions[k], base, -1);
+
+        for (size_t k = 0; k < body->count; ++k)
+        {
+            ir_instruction_t *instruction = &instructions[count++];
+            *instruction = body->instructions[k];
+            if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL)
+                instruction->operand += base;
+        }
+
+        if (body->height > 0)
+        {
+            instructions[count++] = (ir_instruction_t){
+                .op = OP_SET_LOCAL,
+                .constant = NIL_VAL,
+                .operand = base,
+                .args = {IR_INPUT, IR_INPUT}};
+
+            for (size_t k = 0; k < body->height; ++k)
+                instructions[count++] = (ir_instruction_t){
+                    .op = OP_POP,
+                    .constant = NIL_VAL,
+                    .args = {IR_INPUT, IR_INPUT}};
+        }
+    }
+    map[ir->count] = count;
+
+    for (size_t i = 0; i < count; ++i)
+        if (is_jump(instructions[i].op))
+            instructions[i].operand = map[instructions[i].operand];
+
+    memory_free(map);
+    memory_free(ir->instructions);
+    ir->instructions = instructions;
+    ir->count = count;
+    split_blocks(ir);
+
+    return true;
+}
+
+// Reads of a local slot whose value is the same constant on every path
+static bool pass_propagate(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->op == OP_GET_LOCAL && !instruction->dead &&
+            ir->blocks[block_of(ir, i)].reachable &&
+            instruction->result.kind == IR_LATTICE_CONSTANT)
+            make_constant(instruction, instruction->result.value);
+    }
+
+    return true;
+}
+
+// Expressions a lower slot already holds the result of, usually a local it was
+// assigned to, read that slot instead when their operands can be dropped
+static bool pass_cse(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->dead || instruction->available == SIZE_MAX || !ir->blocks[block_of(ir, i)].reachable)
+            continue;
+
+        size_t arity = pure_arity(instruction->op);
+        if (arity == 0 || !removable_operands(ir, instruction, arity))
+            continue;
+
+        for (size_t k = arity; k > 0; --k)
+            remove_push(ir, (size_t)instruction->args[k - 1], i);
+
+        instruction->op = OP_GET_LOCAL;
+        instruction->operand = instruction->available;
+        instruction->args[0] = IR_INPUT;
+        instruction->args[1] = IR_INPUT;
+    }
+
+    return true;
+}
+
+// Reads of a slot holding a copy of a lower one, a local initialized or assigned
+// from another, read the lower one. Once nothing reads the copy dce can drop it
+static bool pass_copy(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->op == OP_GET_LOCAL && !instruction->dead && instruction->available != SIZE_MAX &&
+            ir->blocks[block_of(ir, i)].reachable)
+            instruction->operand = instruction->available;
+    }
+
+    return true;
+}
+
+// Operations whose operands are all constants pushed right before them
+static bool pass_fold(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->dead || instruction->result.kind != IR_LATTICE_CONSTANT ||
+            !ir->blocks[block_of(ir, i)].reachable)
+            continue;
+
+        size_t arity = pure_arity(instruction->op);
+        if (arity == 0 || !removable_operands(ir, instruction, arity))
+            continue;
+
+        for (size_t k = arity; k > 0; --k)
+            remove_push(ir, (size_t)instruction->args[k - 1], i);
+        make_constant(instruction, instruction->result.value);
+    }
+
+    return true;
+}
+
+// Conditional jumps on a known condition, then code that became unreachable
+// and jumps to the next instruction
+static bool pass_branch(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->op != OP_JUMP_IF_FALSE || instruction->dead ||
+            !ir->blocks[block_of(ir, i)].reachable ||
+            instruction->result.kind != IR_LATTICE_CONSTANT || !IS_TRUTHY(instruction->result.value))
+            continue;
+
+        if (AS_TRUTHY(instruction->result.value))
+            instruction->dead = true;
+        else
+            instruction->op = OP_JUMP;
+    }
+
+    if (!ir_analyze(ir))
+        return false;
+
+    for (size_t b = 0; b < ir->blocks_count; ++b)
+        if (!ir->blocks[b].reachable)
+            for (size_t i = ir->blocks[b].start; i < ir->blocks[b].end; ++i)
+                ir->instructions[i].dead = true;
+
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->op != OP_JUMP || instruction->dead)
+            continue;
+
+        size_t next = i + 1;
+        while (next < ir->count && ir->instructions[next].dead)
+            next++;
+
+        size_t target = instruction->operand;
+        while (target < ir->count && ir->instructions[target].dead)
+            target++;
+
+        if (target == next)
+            instruction->dead = true;
+    }
+
+    return true;
+}
+
+// Pure values that are popped right away
+static bool pass_dce(ir_function_t *ir)
+{
+    for (size_t i = 0; i < ir->count; ++i)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        if (instruction->op != OP_POP || instruction->dead || instruction->args[0] == IR_INPUT ||
+            !ir->blocks[block_of(ir, i)].reachable)
+            continue;
+
+        ir_instruction_t *value = &ir->instructions[instruction->args[0]];
+        if (is_leaf(value) && value->uses == 1)
+        {
+            remove_push(ir, (size_t)instruction->args[0], i);
+            instruction->dead = true;
+        }
+    }
+
+    return true;
+}
+
+const ir_pass_t *ir_pass_find(const char *name, size_t length)
+{
+    for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); ++i)
+        if (strlen(passes[i].name) == length && strncmp(passes[i].name, name, length) == 0)
+            return &passes[i];
+
+    return NULL;
+}
+
+void ir_pipeline_default(ir_pipeline_t *pipeline)
+{
+    pipeline->count = 0;
+    for (size_t i = 0; i < sizeof(default_pipeline) / sizeof(default_pipeline[0]); ++i)
+        pipeline->passes[pipeline->count++] = ir_pass_find(default_pipeline[i], strlen(default_pipeline[i]));
+}
+
+// Comma separated pass names, e.g "propagate,cse,fold,dce"
+bool ir_pipeline_parse(ir_pipeline_t *pipeline, const char *spec)
+{
+    pipeline->count = 0;
+
+    while (*spec != '\0')
+    {
+        const char *end = strchr(spec, ',');
+        size_t length = end == NULL ? strlen(spec) : (size_t)(end - spec);
+
+        const ir_pass_t *pass = ir_pass_find(spec, length);
+        if (pass == NULL || pipeline->count >= CLOX_IR_PIPELINE_MAX)
+        {
+            fprintf(stderr, "ERROR: Unknown optimization pass '%.*s'\n", (int)length, spec);
+            return false;
+        }
+
+        pipeline->passes[pipeline->count++] = pass;
+        spec += length + (end != NULL);
+    }
+
+    return true;
+}
+
+static bool optimize(object_function_t *function, const ir_pipeline_t *pipeline, const ir_unit_t *unit)
+{
+    ir_function_t ir;
+    program_t program;
+
+    bool ok = ir_build(&ir, function);
+    ir.unit = unit;
+
+    for (size_t i = 0; ok && i < pipeline->count; ++i)
+        ok = ir_analyze(&ir) && pipeline->passes[i]->run(&ir);
+
+    ok = ok && ir_analyze(&ir);
+
+#ifdef CLOX_DEBUG_PRINT
+    if (ok)
+        ir_print(&ir);
+#endif // CLOX_DEBUG_PRINT
+
+    // The original bytecode is kept whenever the function can't be lifted or lowered
+    if (ok && (ok = ir_lower(&ir, &program)))
+    {
+        program_free(&function->program);
+        function->program = program;
+    }
+
+    ir_free(&ir);
+    return ok;
+}
+
+bool ir_optimize(object_function_t *function, const ir_pipeline_t *pipeline)
+{
+    return optimize(function, pipeline, NULL);
+}
+
+// Nested functions come before the function that declares them
+static size_t collect_functions(object_function_t *function, object_function_t **out, size_t count)
+{
+    const value_array_t *constants = &function->program.constants;
+    for (size_t i = 0; i < constants->count; ++i)
+        if (IS_FUNCTION(constants->items[i]))
+            count = collect_functions(AS_FUNCTION(constants->items[i]), out, count);
+
+    if (out != NULL)
+        out[count] = function;
+    return count + 1;
+}
+
+static bool assigned_elsewhere(const ir_unit_t *unit, const object_string_t *name, const chunk *definition)
+{
+    for (size_t f = 0; f < unit->functions_count; ++f)
+    {
+        const program_t *program = &unit->functions[f]->program;
+        for (size_t offset = 0; offset < program->chunks.count;)
+        {
+            const chunk *code = &program->chunks.items[offset];
+            int size = program_operand_size(code[0]);
+            if (size < 0)
+                return true;
+
+            if ((code[0] == OP_DEFINE_GLOBAL || code[0] == OP_SET_GLOBAL) && code != definition &&
+                object_string_cmp(name, AS_STRING(program->constants.items[code[1]])))
+                return true;
+
+            offset += 1 + (size_t)size;
+        }
+    }
+
+    return false;
+}
+
+static bool inline_body_build(ir_inline_body_t *body, object_function_t *function)
+{
+    ir_function_t ir;
+    bool ok = ir_build(&ir, function) && ir_analyze(&ir);
+
+    // The first block has to end with the function's first OP_RETURN
+    const ir_block_t *block = ok ? &ir.blocks[0] : NULL;
+    ok = ok && block->end - block->start - 1 <= CLOX_INLINE_MAX &&
+         ir.instructions[block->end - 1].op == OP_RETURN;
+
+    for (size_t i = 0; ok && i + 1 < (block != NULL ? block->end : 0); ++i)
+    {
+        switch (ir.instructions[i].op)
+        {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_DEFINE_GLOBAL:
+            ok = false;
+            break;
+        default: {}
+        }
+    }
+
+    if (ok)
+    {
+        *body = (ir_inline_body_t){
+            .function = function,
+            .count = block->end - 1,
+            .height = ir.instructions[block->end - 1].height - 1};
+
+        body->instructions = (ir_instruction_t *)memory_allocate(NULL, (body->count + 1) * sizeof(ir_instruction_t), false);
+        memcpy(body->instructions, ir.instructions, body->count * sizeof(ir_instruction_t));
+    }
+
+    ir_free(&ir);
+    return ok;
+}
+
+// Functions are collected after the ones they enclose, each one ends its own range
+static void find_created(ir_unit_t *unit, const size_t offset, object_function_t *function)
+{
+    size_t last = 0;
+    while (unit->functions[last] != function)
+        last++;
+
+    for (size_t f = last + 1 - collect_functions(function, NULL, 0); f <= last; ++f)
+        unit->created[f] = offset;
+}
+
+// Top-level declarations are an OP_CONSTANT of the function followed by its OP_DEFINE_GLOBAL
+static void find_inlinable(ir_unit_t *unit)
+{
+    const program_t *program = &unit->main->program;
+    unit->inlinable = (ir_inline_body_t *)memory_allocate(NULL, (unit->functions_count + 1) * sizeof(ir_inline_body_t), false);
+    unit->created = (size_t *)memory_allocate(NULL, unit->functions_count * sizeof(size_t), false);
+    for (size_t f = 0; f < unit->functions_count; ++f)
+        unit->created[f] = SIZE_MAX;
+
+    for (size_t offset = 0; offset < program->chunks.count;)
+    {
+        const chunk *code = &program->chunks.items[offset];
+        int size = program_operand_size(code[0]);
+        if (size < 0)
+            return;
+
+        if (code[0] == OP_CONSTANT && IS_FUNCTION(program->constants.items[code[1]]))
+            find_created(unit, offset, AS_FUNCTION(program->constants.items[code[1]]));
+
+        offset += 1 + (size_t)size;
+
+        if (offset + 1 >= program->chunks.count || code[0] != OP_CONSTANT || code[2] != OP_DEFINE_GLOBAL ||
+            !IS_FUNCTION(program->constants.items[code[1]]))
+            continue;
+
+        object_function_t *function = AS_FUNCTION(program->constants.items[code[1]]);
+        if (!object_string_cmp(function->name, AS_STRING(program->constants.items[code[3]])) ||
+            assigned_elsewhere(unit, function->name, &code[2]))
+            continue;
+
+        if (inline_body_build(&unit->inlinable[unit->inlinable_count], function))
+            unit->inlinable[unit->inlinable_count++].defined = offset;
+    }
+}
+
+void ir_optimize_unit(object_function_t *main, const ir_pipeline_t *pipeline, bool inline_calls)
+{
+    ir_unit_t unit = {.main = main};
+
+    unit.functions_count = collect_functions(main, NULL, 0);
+    unit.functions = (object_function_t **)memory_allocate(NULL, unit.functions_count * sizeof(object_function_t *), false);
+    collect_functions(main, unit.functions, 0);
+
+    if (inline_calls)
+        find_inlinable(&unit);
+
+    for (size_t i = 0; i < unit.functions_count; ++i)
+        optimize(unit.functions[i], pipeline, &unit);
+
+    for (size_t i = 0; i < unit.inlinable_count; ++i)
+        memory_free(unit.inlinable[i].instructions);
+    memory_free(unit.inlinable);
+    memory_free(unit.created);
+    memory_free(unit.functions);
+}
@@ -3,30 +3,42 @@
 #include "vm.h"
 #include "compiler.h"
 #include "program.h"
+#include "source.h"
+#include "image.h"
+#include "prelude.h"
+#include "gc.h"
 
 // FIXME
 vm_t vm;
+compiler_options_t options;
+ir_pipeline_t pipeline;
 
 static interpret_result_t execute(const char *source)
 {
     compiler_t compiler;
-    if (compiler_run(&compiler, source) != 0)
+    if (compiler_run(&compiler, source, &options) != 0)
         return INTERPRET_RESULT_COMPILE_ERROR;
 
 #if CLOX_DEBUG_PRINT
     program_disassemble(&compiler.context->function->program, "Main Program");
 #endif // CLOX_DEBUG_PRINT
 
-    vm_interpret(&vm, compiler.context->function);
+    options.globals = compiler.context;
+    interpret_result_t result = vm_interpret(&vm, compiler.context->function, &options);
+    options.globals = NULL;
     compiler_free(&compiler);
 
-    return INTERPRET_RESULT_OK;
+    return result;
 }
 
 static void repl()
 {
     char line[UINT8_MAX * 4];
 
+    // Lazy functions point into the source, which is overwritten by the next line
+    options.lazy = false;
+    options.incremental = true;
+
     printf("> ");
     while (fgets(line, sizeof(line), stdin))
     {
@@ -37,77 +49,289 @@ static void repl()
     printf("\n");
 }
 
-static int read_file(const char *filename, char **output)
+static interpret_result_t from_file(const char *content)
 {
-    int ret = 0;
-    FILE *file = fopen(filename, "rb");
+    return execute(content);
+}
 
-    if (file == NULL)
+static interpret_result_t from_cache(const char *filename, const source_t *source)
+{
+    // Only whole functions can be stored, there is no source left to compile lazily
+    options.lazy = false;
+
+    char *path = image_cache_path(filename);
+    uint64_t key = image_cache_key(source->data, source->length, options.pipeline);
+
+    object_function_t *function = image_cache_load(path, key);
+    if (function == NULL)
     {
-        fprintf(stderr, "ERROR: Couldn't open file %s, file not found\n", filename);
-        ret = 1;
-        goto exit;
+        compiler_t compiler;
+        if (compiler_run(&compiler, source->data, &options) != 0)
+        {
+            memory_free(path);
+            return INTERPRET_RESULT_COMPILE_ERROR;
+        }
+
+        function = compiler.context->function;
+        compiler_free(&compiler);
+
+        // Best effort, the script runs anyway
+        image_cache_save(path, function, key);
     }
 
-    if ((ret = fseek(file, 0L, SEEK_END)) < 0)
+    memory_free(path);
+
+    return vm_interpret(&vm, function, &options);
+}
+
+// Writes the image of the script instead of running it, that's how the build
+// compiles the prelude
+static interpret_result_t compile_to(const char *path, const source_t *source)
+{
+    options.lazy = false;
+
+    compiler_t compiler;
+    if (compiler_run(&compiler, source->data, &options) != 0)
+        return INTERPRET_RESULT_COMPILE_ERROR;
+
+    object_function_t *function = compiler.context->function;
+    compiler_free(&compiler);
+
+    image_buffer_t buffer = {0};
+    bool written = image_write(&buffer, function, 0) && image_save(path, &buffer);
+    if (!written)
+        fprintf(stderr, "ERROR: Couldn't write the image %s\n", path);
+
+    image_buffer_free(&buffer);
+
+    return written ? INTERPRET_RESULT_OK : INTERPRET_RESULT_RUNTIME_ERROR;
+}
+
+#if CLOX_PRELUDE
+static void load_prelude(void)
+{
+    object_function_t *prelude = image_read(prelude_image, prelude_image_length, 0);
+    assert(prelude != NULL && "Embedded prelude doesn't match the interpreter");
+
+    vm_interpret_builtins(&vm, prelude, &options);
+}
+#endif // CLOX_PRELUDE
+
+// Each top-level declaration is compiled and run as soon as it has been read, like the
+// lines of the REPL, so memory is bounded by the largest one
+static int from_stream(FILE *file)
+{
+    // The window holding a lazy function's body is gone by the time it's called
+    options.lazy = false;
+    options.incremental = true;
+
+    source_stream_t stream;
+    source_stream_init(&stream, file);
+
+    interpret_result_t result = INTERPRET_RESULT_OK;
+    const char *declaration;
+    while (result == INTERPRET_RESULT_OK && (declaration = source_stream_next(&stream)) != NULL)
     {
-        fprintf(stderr, "ERROR: Couldn't read file %s, %s\n", filename, strerror(ret));
-        goto close;
+        options.first_line = stream.line;
+        result = execute(declaration);
     }
+    options.first_line = 0;
 
-    long file_size = ftell(file);
-    if (file_size < 0)
+    if (result == INTERPRET_RESULT_OK && stream.error != 0)
     {
-        fprintf(stderr, "ERROR: Couldn't read file %s, %s\n", filename, strerror((int)file_size));
-        goto close;
+        fprintf(stderr, "ERROR: Couldn't read the script, %s\n", strerror(stream.error));
+        result = INTERPRET_RESULT_RUNTIME_ERROR;
     }
 
-    rewind(file);
+    source_stream_free(&stream);
+    return (int)result;
+}
 
-    *output = (char *)malloc((size_t)file_size + 1);
-    assert(*output != NULL);
+// Modules are imported from the directory of the script, the working one otherwise
+static char *modules_path(const char *filename)
+{
+    const char *slash = filename != NULL ? strrchr(filename, '/') : NULL;
+    if (slash == NULL)
+        return NULL;
 
-    fread(*output, sizeof(char), (size_t)file_size, file);
-    (*output)[file_size] = '\0';
+    size_t length = slash == filename ? 1 : (size_t)(slash - filename);
+    char *path = (char *)memory_allocate(NULL, length + 1, false);
+    memcpy(path, filename, length);
+    path[length] = '\0';
 
-close:
-    fclose(file);
-exit:
-    return ret;
+    return path;
 }
 
-static interpret_result_t from_file(const char *content)
+static void usage(void)
 {
-    return execute(content);
+    fprintf(stderr, "Usage: clox [-O[=pass,...]] [--lazy] [--pretokenize[=threads]] [--stream] [--cache]\n"
+                    "            [--restore=image] [--snapshot=image] [--compile=image] [--gc-stats] [--pool-stats]\n"
+                    "            [--mem-stats] [script]\n");
 }
 
 int main(int argc, const char *argv[])
 {
     int ret = 0;
+    const char *filename = NULL;
+    bool stream = false;
+    const char *restore = NULL;
+    const char *snapshot = NULL;
+    const char *compile = NULL;
+    bool stats = false;
+    bool pool_stats = false;
+    bool mem_stats = false;
 
-    if (argc > 2)
+    for (int i = 1; i < argc; ++i)
     {
-        fprintf(stderr, "Usage\n");
-        return 64;
+        if (strcmp(argv[i], "-O") == 0)
+        {
+            ir_pipeline_default(&pipeline);
+            options.pipeline = &pipeline;
+        }
+        else if (strncmp(argv[i], "-O=", 3) == 0)
+        {
+            if (!ir_pipeline_parse(&pipeline, argv[i] + 3))
+                return 64;
+            options.pipeline = &pipeline;
+        }
+        else if (strcmp(argv[i], "--lazy") == 0)
+        {
+            options.lazy = true;
+        }
+        else if (strcmp(argv[i], "--pretokenize") == 0)
+        {
+            options.pretokenize = true;
+        }
+        else if (strncmp(argv[i], "--pretokenize=", 14) == 0)
+        {
+            char *end;
+            options.pretokenize = true;
+            options.threads = strtoul(argv[i] + 14, &end, 10);
+            if (*end != '\0' || end == argv[i] + 14)
+            {
+                usage();
+                return 64;
+            }
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            options.cache = true;
+        }
+        else if (strncmp(argv[i], "--restore=", 10) == 0)
+        {
+            restore = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0)
+        {
+            snapshot = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--compile=", 10) == 0)
+        {
+            compile = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+        {
+            stats = true;
+        }
+        else if (strcmp(argv[i], "--pool-stats") == 0)
+        {
+            pool_stats = true;
+        }
+        else if (strcmp(argv[i], "--mem-stats") == 0)
+        {
+            mem_stats = true;
+        }
+        else if (argv[i][0] != '-' && filename == NULL)
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            usage();
+            return 64;
+        }
     }
 
+    // Functions are saved compiled, lazy ones would need the source
+    if (snapshot != NULL)
+        options.lazy = false;
+
     vm_init(&vm);
 
-    if (argc == 1)
+    char *path = modules_path(filename);
+    if (path != NULL)
+        vm.modules_path = path;
+
+#if CLOX_PRELUDE
+    load_prelude();
+#endif // CLOX_PRELUDE
+
+    if (restore != NULL && !vm_snapshot_load(&vm, restore))
+    {
+        fprintf(stderr, "ERROR: Couldn't restore %s, it's missing or not from this build\n", restore);
+        vm_free(&vm);
+        memory_pools_free();
+        memory_free(path);
+        return 1;
+    }
+
+    if (stream)
+    {
+        FILE *file = filename != NULL ? fopen(filename, "rb") : stdin;
+        if (file == NULL)
+        {
+            fprintf(stderr, "ERROR: Couldn't read file %s, %s\n", filename, strerror(errno));
+            ret = 1;
+        }
+        else
+        {
+            ret = from_stream(file);
+            if (file != stdin)
+                fclose(file);
+        }
+    }
+    else if (filename == NULL)
     {
         repl();
     }
     else
     {
-        char *content = NULL;
-        if ((ret = read_file(argv[1], &content)) == 0)
+        source_t source;
+        if ((ret = source_open(&source, filename)) != 0)
+        {
+            fprintf(stderr, "ERROR: Couldn't read file %s, %s\n", filename, strerror(ret));
+            ret = 1;
+        }
+        else
         {
-            ret = (int)from_file(content);
+            if (compile != NULL)
+                ret = (int)compile_to(compile, &source);
+            else
+                ret = (int)(options.cache ? from_cache(filename, &source) : from_file(source.data));
+            source_close(&source);
         }
+    }
 
-        free(content);
+    if (ret == 0 && snapshot != NULL && !vm_snapshot_save(&vm, snapshot))
+    {
+        fprintf(stderr, "ERROR: Couldn't write the snapshot %s: the file can't be written or a global\n"
+                        "       holds a function of a module or of the prelude\n", snapshot);
+        ret = 1;
     }
 
+    if (stats)
+        gc_stats_print();
+    if (pool_stats)
+        memory_pools_print();
+    if (mem_stats)
+        vm_memory_print(&vm);
+
     vm_free(&vm);
+    memory_pools_free();
+    memory_free(path);
     return ret;
 }
@@ -1,18 +1,204 @@
 #include "memory.h"
 
+typedef struct memory_slot
+{
+    struct memory_slot *next;
+} memory_slot_t;
+
+// Followed by its slots, the header is padded to keep them aligned
+typedef struct memory_slab
+{
+    struct memory_slab *next;
+} memory_slab_t;
+
+#define MEMORY_SLAB_HEADER \
+    ((sizeof(memory_slab_t) + CLOX_MEMORY_POOL_GRANULE - 1) / CLOX_MEMORY_POOL_GRANULE * CLOX_MEMORY_POOL_GRANULE)
+
+typedef struct memory_pool
+{
+    memory_slot_t *free;
+    memory_slab_t *slabs;
+    memory_pool_stats_t stats;
+} memory_pool_t;
+
+static memory_pool_t pools[CLOX_MEMORY_POOL_CLASSES];
+
+static memory_stats_t counters;
+
+// Keeps what follows it aligned like malloc would
+#define MEMORY_HEADER 16
+
+#define MEMORY_ADD(counter, n) __atomic_add_fetch(&counters.counter, (n), __ATOMIC_RELAXED)
+#define MEMORY_SUB(counter, n) __atomic_sub_fetch(&counters.counter, (n), __ATOMIC_RELAXED)
+#define MEMORY_LOAD(counter) __atomic_load_n(&counters.counter, __ATOMIC_RELAXED)
+
+static void memory_count(size_t allocated, size_t freed)
+{
+    MEMORY_ADD(allocations, 1);
+    MEMORY_ADD(total, allocated);
+
+    // Wraps around when a reallocation shrinks the block
+    size_t bytes = MEMORY_ADD(bytes, allocated - freed);
+
+    size_t peak = MEMORY_LOAD(peak);
+    while (bytes > peak && !__atomic_compare_exchange_n(&counters.peak, &peak, bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Reallocates ptr unless it's NULL, zinit clears the bytes past its old size
 void *memory_allocate(void *ptr, size_t size, bool zinit)
 {
-    ptr = NULL;
-    void *memory = realloc(ptr, size);
-    assert((memory != NULL) && "Memory allocation failed: Couldn't allocate more memory");
+    uint8_t *block = NULL;
+    size_t old_size = 0;
+    if (ptr != NULL)
+    {
+        block = (uint8_t *)ptr - MEMORY_HEADER;
+        memcpy(&old_size, block, sizeof(old_size));
+    }
 
-    if (zinit)
-        memset(memory, 0, size);
+    block = (uint8_t *)realloc(block, MEMORY_HEADER + size);
+    assert((block != NULL) && "Memory allocation failed: Couldn't allocate more memory");
+    memcpy(block, &size, sizeof(size));
+    memory_count(size, old_size);
+
+    uint8_t *memory = block + MEMORY_HEADER;
+    if (zinit && size > old_size)
+        memset(memory + old_size, 0, size - old_size);
 
     return memory;
 }
 
 void memory_free(void *ptr)
 {
-    free(ptr);
+    if (ptr == NULL)
+        return;
+
+    uint8_t *block = (uint8_t *)ptr - MEMORY_HEADER;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+
+    MEMORY_ADD(frees, 1);
+    MEMORY_SUB(bytes, size);
+    free(block);
+}
+
+memory_stats_t memory_stats(void)
+{
+    return (memory_stats_t){
+        .allocations = MEMORY_LOAD(allocations),
+        .frees = MEMORY_LOAD(frees),
+        .bytes = MEMORY_LOAD(bytes),
+        .peak = MEMORY_LOAD(peak),
+        .total = MEMORY_LOAD(total),
+        .growths = MEMORY_LOAD(growths)};
+}
+
+void memory_count_growth(void)
+{
+    MEMORY_ADD(growths, 1);
+}
+
+static size_t memory_pool_class(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / CLOX_MEMORY_POOL_GRANULE;
+}
+
+#if CLOX_MEMORY_POOLS
+// Slots are linked in address order, consecutive allocations end up side by side
+static void memory_pool_grow(memory_pool_t *pool, size_t slot_size)
+{
+    memory_slab_t *slab = (memory_slab_t *)memory_allocate(NULL, CLOX_MEMORY_POOL_SLAB, false);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->stats.slabs++;
+
+    uint8_t *slots = (uint8_t *)slab + MEMORY_SLAB_HEADER;
+    size_t count = (CLOX_MEMORY_POOL_SLAB - MEMORY_SLAB_HEADER) / slot_size;
+    for (size_t i = count; i > 0; --i)
+    {
+        memory_slot_t *slot = (memory_slot_t *)(slots + (i - 1) * slot_size);
+        slot->next = pool->free;
+        pool->free = slot;
+    }
+}
+#endif // CLOX_MEMORY_POOLS
+
+void *memory_pool_allocate(size_t size)
+{
+    size_t size_class = memory_pool_class(size);
+    if (size_class >= CLOX_MEMORY_POOL_CLASSES)
+        return memory_allocate(NULL, size, false);
+
+    memory_pool_t *pool = &pools[size_class];
+    pool->stats.size = (size_class + 1) * CLOX_MEMORY_POOL_GRANULE;
+    pool->stats.allocations++;
+    if (++pool->stats.live > pool->stats.peak)
+        pool->stats.peak = pool->stats.live;
+
+#if CLOX_MEMORY_POOLS
+    if (pool->free == NULL)
+        memory_pool_grow(pool, pool->stats.size);
+
+    memory_slot_t *slot = pool->free;
+    pool->free = slot->next;
+    return slot;
+#else
+    return memory_allocate(NULL, size, false);
+#endif // CLOX_MEMORY_POOLS
+}
+
+void memory_pool_free(void *ptr, size_t size)
+{
+    size_t size_class = memory_pool_class(size);
+    if (size_class >= CLOX_MEMORY_POOL_CLASSES)
+    {
+        memory_free(ptr);
+        return;
+    }
+
+    memory_pool_t *pool = &pools[size_class];
+    pool->stats.frees++;
+    pool->stats.live--;
+
+#if CLOX_MEMORY_POOLS
+    memory_slot_t *slot = (memory_slot_t *)ptr;
+    slot->next = pool->free;
+    pool->free = slot;
+#else
+    memory_free(ptr);
+#endif // CLOX_MEMORY_POOLS
+}
+
+const memory_pool_stats_t *memory_pool_stats(size_t size_class)
+{
+    assert(size_class < CLOX_MEMORY_POOL_CLASSES);
+    return &pools[size_class].stats;
+}
+
+void memory_pools_print(void)
+{
+    for (size_t i = 0; i < CLOX_MEMORY_POOL_CLASSES; ++i)
+    {
+        const memory_pool_stats_t *stats = &pools[i].stats;
+        if (stats->allocations == 0)
+            continue;
+
+        fprintf(stderr, "[POOL] %3zu bytes: %zu allocations, %zu frees, %zu live (peak %zu), %zu slabs\n",
+                stats->size, stats->allocations, stats->frees, stats->live, stats->peak, stats->slabs);
+    }
+}
+
+void memory_pools_free(void)
+{
+    for (size_t i = 0; i < CLOX_MEMORY_POOL_CLASSES; ++i)
+    {
+        while (pools[i].slabs != NULL)
+        {
+            memory_slab_t *slab = pools[i].slabs;
+            pools[i].slabs = slab->next;
+            memory_free(slab);
+        }
+
+        pools[i].free = NULL;
+    }
 }
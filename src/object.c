@@ -1,20 +1,67 @@
 #include "object.h"
+#include "table.h"
+#include "gc.h"
+
+#define STRING_HASH_SEED 2166136261u // FNV offset basis
+
+static uint32_t string_hash(uint32_t, const char *, const size_t);
+static object_string_t *string_allocate(const size_t, const uint32_t);
+static const object_string_t *string_resolve(const object_string_t *);
+static const char *text_data(const object_t *);
+static size_t text_length(const object_t *);
+static object_rope_t *rope_new(object_builder_t *, const size_t);
 
 object_t *object_new(const object_type_t type, const size_t type_size)
 {
-    object_t *object = NULL;
-    object = (object_t *)memory_allocate(object, type_size, false);
+    object_t *object = (object_t *)memory_pool_allocate(type_size);
     object->type = type;
+    gc_track(object, type_size);
     return object;
 }
 
-void object_destroy(object_t *object)
+void object_destroy(object_t *object, const size_t type_size)
 {
-    memory_free(object);
+    memory_pool_free(object, type_size);
 }
 
-cmp_t object_cmp(const object_t *a, const object_t *b)
+void object_free(object_t *object)
 {
+    switch (object->type)
+    {
+    case OBJECT_STRING:   { object_string_destroy((object_string_t *)object); } break;
+    case OBJECT_FUNCTION: { object_function_destroy((object_function_t *)object); } break;
+    case OBJECT_NATIVE:   { object_native_destroy((object_native_t *)object); } break;
+    case OBJECT_MODULE:   { object_module_destroy((object_module_t *)object); } break;
+    case OBJECT_BUILDER:  { object_builder_destroy((object_builder_t *)object); } break;
+    case OBJECT_ROPE:     { object_rope_destroy((object_rope_t *)object); } break;
+    default:
+        UNREACHABLE;
+    }
+}
+
+const char *object_type_name(object_type_t type)
+{
+    static const char *names[] =
+    {
+        [OBJECT_STRING] = "string",
+        [OBJECT_FUNCTION] = "function",
+        [OBJECT_NATIVE] = "native",
+        [OBJECT_MODULE] = "module",
+        [OBJECT_BUILDER] = "builder",
+        [OBJECT_ROPE] = "rope",
+    };
+
+    return type < OBJECT_COUNT ? names[type] : "unknown";
+}
+
+cmp_t object_cmp(object_t *a, object_t *b)
+{
+    // Ropes compare as the string they flatten to
+    if (a->type == OBJECT_ROPE)
+        a = (object_t *)object_flatten(a);
+    if (b->type == OBJECT_ROPE)
+        b = (object_t *)object_flatten(b);
+
     if (a->type != b->type)
         return CMP_ERROR;
     
@@ -28,6 +75,8 @@ cmp_t object_cmp(const object_t *a, const object_t *b)
                        ? CMP_EQUAL
                        : CMP_NOT_EQUAL;
         }
+    case OBJECT_BUILDER:
+        return a == b ? CMP_EQUAL : CMP_NOT_EQUAL;
     default:
         UNREACHABLE;
     }
@@ -51,43 +100,159 @@ void object_print(const object_t *object)
         {
             printf("<fn native> ");
         } break;
+    case OBJECT_MODULE:
+        {
+            const object_module_t *module = (const object_module_t *)object;
+            printf("<module '%.*s'> ", (int)module->name->length, module->name->data);
+        } break;
+    case OBJECT_BUILDER:
+        {
+            printf("<builder> ");
+        } break;
+    case OBJECT_ROPE:
+        {
+            const object_rope_t *rope = (const object_rope_t *)object;
+            printf("'%.*s' ", (int)rope->length, rope->builder->data);
+        } break;
     default:
         UNREACHABLE;
     }
 }
 
-object_string_t *object_string_new(const char *data, const size_t length)
+// FNV-1a, continued from hash so that a concatenation hashes its parts in turn
+static uint32_t string_hash(uint32_t hash, const char *data, const size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// In the old space, the caller writes the characters and interns the string
+static object_string_t *string_allocate(const size_t length, const uint32_t hash)
 {
-    object_string_t *string = (object_string_t *)object_new(OBJECT_STRING, sizeof(object_string_t));
+    object_string_t *string = (object_string_t *)object_new(OBJECT_STRING, STRING_SIZE(length));
     string->length = length;
-    string->data = (char *)memory_allocate(string->data, sizeof(char) * length, false);
-    memcpy(string->data, data, length);
+    string->hash = hash;
     return string;
 }
 
+// A young string promoted early is still referenced until the next minor collection
+static const object_string_t *string_resolve(const object_string_t *string)
+{
+    return string->object.young && string->object.marked ? (const object_string_t *)string->object.next : string;
+}
+
+object_string_t *object_string_new(const char *data, const size_t length)
+{
+    uint32_t hash = string_hash(STRING_HASH_SEED, data, length);
+
+    object_string_t *string = gc_intern_find(data, length, hash, false);
+    if (string == NULL)
+    {
+        string = string_allocate(length, hash);
+        memcpy(string->data, data, length);
+        gc_intern(string);
+    }
+
+    return string;
+}
+
+object_string_t *object_string_copy(const object_string_t *string)
+{
+    object_string_t *copy = string_allocate(string->length, string->hash);
+    memcpy(copy->data, string->data, string->length);
+    return copy;
+}
+
 void object_string_destroy(object_string_t *object_string)
 {
-    memory_free(object_string->data);
-    object_destroy((object_t *)object_string);
+    object_destroy((object_t *)object_string, STRING_SIZE(object_string->length));
 }
 
 object_string_t *object_string_concat(object_string_t *a, object_string_t *b)
 {
-    object_string_t *string = (object_string_t *)object_new(OBJECT_STRING, sizeof(object_string_t));
-    string->length = a->length + b->length;
-    string->data = (char *)memory_allocate(string->data, sizeof(char) * string->length, false);
+    size_t length = a->length + b->length;
+    uint32_t hash = string_hash(string_hash(STRING_HASH_SEED, b->data, b->length), a->data, a->length);
+
+    // Most results are intermediates, they start in the nursery. One that is already
+    // interned is left to the collector, it costs its space until the next collection.
+    object_string_t *string = (object_string_t *)gc_allocate_young(OBJECT_STRING, STRING_SIZE(length));
+    if (string != NULL)
+    {
+        string->length = length;
+        string->hash = hash;
+    }
+    else
+    {
+        string = string_allocate(length, hash);
+    }
+
     memcpy(string->data, b->data, b->length);
     memcpy(string->data + b->length, a->data, a->length);
 
-    object_string_destroy(a);
-    object_string_destroy(b);
+    // Young strings are fine here, the result goes on the value stack
+    object_string_t *interned = gc_intern_find(string->data, length, hash, true);
+    if (interned != NULL)
+        return interned;
+
+    gc_intern(string);
 
+    // The operands may still be referenced, the collector frees them once they aren't
     return string;
 }
 
 bool object_string_cmp(const object_string_t *a, const object_string_t *b)
 {
-    return a->length == b->length && memcmp(a->data, b->data, a->length) == 0;
+    return string_resolve(a) == string_resolve(b);
+}
+
+static const char *text_data(const object_t *text)
+{
+    return text->type == OBJECT_STRING ? ((const object_string_t *)text)->data
+                                       : ((const object_rope_t *)text)->builder->data;
+}
+
+static size_t text_length(const object_t *text)
+{
+    return text->type == OBJECT_STRING ? ((const object_string_t *)text)->length
+                                       : ((const object_rope_t *)text)->length;
+}
+
+object_t *object_concat(object_t *a, object_t *b)
+{
+    if (a->type == OBJECT_STRING && b->type == OBJECT_STRING && text_length(a) + text_length(b) < CLOX_ROPE_MIN)
+        return (object_t *)object_string_concat((object_string_t *)a, (object_string_t *)b);
+
+    // The last rope of a chain is extended in place, any other text is copied once
+    object_rope_t *rope = b->type == OBJECT_ROPE ? (object_rope_t *)b : NULL;
+    object_builder_t *builder;
+    if (rope != NULL && rope->length == rope->builder->length)
+    {
+        builder = rope->builder;
+    }
+    else
+    {
+        builder = object_builder_new();
+        object_builder_append(builder, b);
+    }
+    object_builder_append(builder, a);
+
+    return (object_t *)rope_new(builder, builder->length);
+}
+
+object_string_t *object_flatten(object_t *text)
+{
+    if (text->type == OBJECT_STRING)
+        return (object_string_t *)text;
+
+    object_rope_t *rope = (object_rope_t *)text;
+    if (rope->flat == NULL)
+        rope->flat = object_string_new(rope->builder->data, rope->length);
+
+    return rope->flat;
 }
 
 object_function_t *object_function_new(const char *name, const size_t arity)
@@ -96,6 +261,9 @@ object_function_t *object_function_new(const char *name, const size_t arity)
     function->name = object_string_new(name, strlen(name));
     function->arity = arity;
     function->program = (program_t){0};
+    function->source = NULL;
+    function->source_line = 0;
+    function->globals = NULL;
 
     return function;
 }
@@ -103,8 +271,7 @@ object_function_t *object_function_new(const char *name, const size_t arity)
 void object_function_destroy(object_function_t *function)
 {
     program_free(&function->program);
-    object_string_destroy(function->name);
-    object_destroy((object_t *)function);
+    object_destroy((object_t *)function, sizeof(object_function_t));
 }
 
 object_native_t *object_native_new(native_fn function)
@@ -117,5 +284,76 @@ object_native_t *object_native_new(native_fn function)
 
 void object_native_destroy(object_native_t *native)
 {
-    object_destroy((object_t *)native);
+    object_destroy((object_t *)native, sizeof(object_native_t));
+}
+
+object_module_t *object_module_new(const object_string_t *name)
+{
+    object_module_t *module = (object_module_t *)object_new(OBJECT_MODULE, sizeof(object_module_t));
+    module->name = object_string_new(name->data, name->length);
+    module->globals = (table_t *)memory_allocate(NULL, sizeof(table_t), false);
+    table_init(module->globals);
+    module->loaded = false;
+
+    return module;
+}
+
+void object_module_destroy(object_module_t *module)
+{
+    memory_free(module->globals->entries);
+    memory_free(module->globals);
+    object_destroy((object_t *)module, sizeof(object_module_t));
+}
+
+object_builder_t *object_builder_new(void)
+{
+    object_builder_t *builder = (object_builder_t *)object_new(OBJECT_BUILDER, sizeof(object_builder_t));
+    builder->data = NULL;
+    builder->length = 0;
+    builder->capacity = 0;
+
+    return builder;
+}
+
+void object_builder_append(object_builder_t *builder, const object_t *text)
+{
+    size_t length = text_length(text);
+    if (builder->length + length > builder->capacity)
+    {
+        size_t capacity = GROW_CAPACITY(builder->capacity);
+        while (capacity < builder->length + length)
+            capacity *= 2;
+
+        if (builder->capacity > 0)
+            memory_count_growth();
+
+        builder->data = (char *)memory_allocate(builder->data, capacity, false);
+        gc_grow(capacity - builder->capacity);
+        builder->capacity = capacity;
+    }
+
+    // Read once grown, the text may be a rope of this builder
+    memcpy(builder->data + builder->length, text_data(text), length);
+    builder->length += length;
+}
+
+void object_builder_destroy(object_builder_t *builder)
+{
+    memory_free(builder->data);
+    object_destroy((object_t *)builder, sizeof(object_builder_t));
+}
+
+static object_rope_t *rope_new(object_builder_t *builder, const size_t length)
+{
+    object_rope_t *rope = (object_rope_t *)object_new(OBJECT_ROPE, sizeof(object_rope_t));
+    rope->builder = builder;
+    rope->length = length;
+    rope->flat = NULL;
+
+    return rope;
+}
+
+void object_rope_destroy(object_rope_t *rope)
+{
+    object_destroy((object_t *)rope, sizeof(object_rope_t));
 }
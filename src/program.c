@@ -10,6 +10,25 @@ void program_init(program_t *program)
     value_array_init(&program->constants);
 }
 
+void program_reserve(program_t *program, size_t chunks, size_t constants)
+{
+    chunk_array_reserve(&program->chunks, chunks);
+    value_array_reserve(&program->constants, constants);
+}
+
+// Once the function is complete, nothing is written to it again
+void program_shrink(program_t *program)
+{
+    chunk_array_shrink_to_fit(&program->chunks);
+    value_array_shrink_to_fit(&program->constants);
+}
+
+// Bytes held by its arrays
+size_t program_size(const program_t *program)
+{
+    return program->chunks.capacity * sizeof(chunk) + program->constants.capacity * sizeof(value_t);
+}
+
 int program_write(program_t *program, op_code_t value, ...)
 {
     assert(value < OP_COUNT);
@@ -25,8 +44,8 @@ int program_write(program_t *program, op_code_t value, ...)
     case OP_DEFINE_GLOBAL:
     case OP_GET_GLOBAL:
     case OP_SET_GLOBAL:
-    case OP_GET_LOCAL:
-    case OP_SET_LOCAL:
+    case OP_IMPORT:
+    case OP_GET_MEMBER:
         {
             if (program->constants.count > UINT8_MAX)
             {
@@ -38,11 +57,19 @@ int program_write(program_t *program, op_code_t value, ...)
             chunk_array_write(&program->chunks, (chunk)program->constants.count - 1);
         } break;
 
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        {
+            int slot = va_arg(args, int);
+            const chunk operand[] = {(chunk)((slot >> 8) & 0xFF), (chunk)((slot >> 0) & 0xFF)};
+            chunk_array_append(&program->chunks, operand, 2);
+        } break;
+
     case OP_JUMP:
     case OP_JUMP_IF_FALSE:
         {
-            chunk_array_write(&program->chunks, 0u);
-            chunk_array_write(&program->chunks, 0u);
+            const chunk target[] = {0u, 0u};
+            chunk_array_append(&program->chunks, target, 2);
             return (int)program->chunks.count - 2;
         }
 
@@ -51,6 +78,28 @@ int program_write(program_t *program, op_code_t value, ...)
             chunk_array_write(&program->chunks, (uint8_t)va_arg(args, int));
             return (int)program->chunks.count - 1;
         }
+
+    case OP_LOOP_LESS:
+    case OP_LOOP_LESS_EQUAL:
+        {
+            for (size_t k = 0; k < 2; ++k)
+            {
+                int slot = va_arg(args, int);
+                const chunk operand[] = {(chunk)((slot >> 8) & 0xFF), (chunk)((slot >> 0) & 0xFF)};
+                chunk_array_append(&program->chunks, operand, 2);
+            }
+
+            if (program->constants.count > UINT8_MAX)
+            {
+                fprintf(stderr, "Too many constants, max is: %d\n", UINT8_MAX);
+                return -1;
+            }
+
+            value_array_write(&program->constants, va_arg(args, value_t));
+            const chunk operand[] = {(chunk)(program->constants.count - 1), 0u, 0u};
+            chunk_array_append(&program->chunks, operand, 3);
+            return (int)program->chunks.count - 2;
+        }
     default: {}
     }
 
@@ -99,14 +148,23 @@ void program_instruction_disassemble(const program_t *program, size_t *i)
             printf("\n");
         } break;
 
-    case OP_GET_LOCAL:
-    case OP_SET_LOCAL:
+    case OP_IMPORT:
+    case OP_GET_MEMBER:
         {
-            printf("OP_LOCAL\t");
+            printf(program->chunks.items[*i] == OP_IMPORT ? "OP_IMPORT\t" : "OP_GET_MEMBER\t");
             value_print(program->constants.items[program->chunks.items[++(*i)]]);
             printf("\n");
         } break;
 
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        {
+            int slot = program->chunks.items[*i + 1] << 8;
+            slot |= program->chunks.items[*i + 2];
+            *i += 2;
+            printf("OP_LOCAL\t%d\n", slot);
+        } break;
+
     case OP_ADD:           { printf("OP_ADD\n"); } break;
     case OP_SUB:           { printf("OP_SUB\n"); } break;
     case OP_MULTI:         { printf("OP_MULTI\n"); } break;
@@ -122,6 +180,17 @@ void program_instruction_disassemble(const program_t *program, size_t *i)
             printf("OP_JUMP\t %d\n", offset);
         } break;
 
+    case OP_LOOP_LESS:
+    case OP_LOOP_LESS_EQUAL:
+        {
+            const chunk *code = &program->chunks.items[*i];
+            printf("%s\t%d %d ", code[0] == OP_LOOP_LESS ? "OP_LOOP_LESS" : "OP_LOOP_LESS_EQUAL",
+                   (code[1] << 8) | code[2], (code[3] << 8) | code[4]);
+            value_print(program->constants.items[code[5]]);
+            printf(" %d\n", (code[6] << 8) | code[7]);
+            *i += 7;
+        } break;
+
     case OP_CALL:
         {
             printf("OP_CALL\t%d\n", program->chunks.items[++(*i)]);
@@ -131,3 +200,109 @@ void program_instruction_disassemble(const program_t *program, size_t *i)
         fprintf(stderr, "Unknown instruction %u\n", program->chunks.items[*i]);
     }
 }
+
+// Bytes after the op code, -1 for unknown instructions
+int program_operand_size(const chunk op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_IMPORT:
+    case OP_GET_MEMBER:
+    case OP_CALL:
+        return 1;
+
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return 2;
+
+    case OP_LOOP_LESS:
+    case OP_LOOP_LESS_EQUAL:
+        return 7;
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MULTI:
+    case OP_DIV:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_RETURN:
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// Evaluates an operator on known operands the way vm_run does (right is ignored by
+// the unary ones), fails where vm_run would raise an error. Strings short enough not
+// to make a rope are concatenated into an interned old string: callers keep it as a
+// constant, and nothing is collected while compiling or optimizing
+bool program_fold(const op_code_t op, const value_t left, const value_t right, value_t *result)
+{
+    switch (op)
+    {
+    case OP_ADD:
+        {
+            if (!IS_STRING(left) || !IS_STRING(right))
+                break;
+
+            const object_string_t *a = AS_STRING(left);
+            const object_string_t *b = AS_STRING(right);
+            if (a->length + b->length >= CLOX_ROPE_MIN)
+                return false;
+
+            char data[CLOX_ROPE_MIN];
+            memcpy(data, a->data, a->length);
+            memcpy(data + a->length, b->data, b->length);
+            *result = OBJECT_VAL(object_string_new(data, a->length + b->length));
+        } return true;
+    case OP_NOT:
+        {
+            if (!IS_TRUTHY(left))
+                return false;
+            *result = BOOL_VAL(IS_NIL(left) || !AS_BOOL(left));
+        } return true;
+    case OP_NEGATE:
+        {
+            if (!IS_NUMBER(left))
+                return false;
+            *result = NUMBER_VAL(-AS_NUMBER(left));
+        } return true;
+    case OP_EQUAL:
+        {
+            cmp_t cmp = value_cmp(right, left);
+            if (cmp == CMP_ERROR)
+                return false;
+            *result = BOOL_VAL(cmp == CMP_EQUAL);
+        } return true;
+    default: {}
+    }
+
+    if (!IS_NUMBER(left) || !IS_NUMBER(right))
+        return false;
+
+    switch (op)
+    {
+    case OP_ADD:     { *result = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)); } return true;
+    case OP_SUB:     { *result = NUMBER_VAL(AS_NUMBER(left) - AS_NUMBER(right)); } return true;
+    case OP_MULTI:   { *result = NUMBER_VAL(AS_NUMBER(left) * AS_NUMBER(right)); } return true;
+    case OP_DIV:     { *result = NUMBER_VAL(AS_NUMBER(left) / AS_NUMBER(right)); } return true;
+    case OP_GREATER: { *result = BOOL_VAL(AS_NUMBER(left) < AS_NUMBER(right)); } return true;
+    case OP_LESS:    { *result = BOOL_VAL(AS_NUMBER(left) > AS_NUMBER(right)); } return true;
+    default:         return false;
+    }
+}
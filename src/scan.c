@@ -0,0 +1,172 @@
+#include "scan.h"
+#include <pthread.h>
+
+#if CLOX_SCAN_SIMD
+#include <immintrin.h>
+#endif // CLOX_SCAN_SIMD
+
+typedef const char *(*scan_fn)(const char *, const scan_class_t, size_t *);
+
+static const char *scan_scalar(const char *, const scan_class_t, size_t *);
+static void scan_select(void);
+static scan_fn scan = scan_scalar;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static bool in_class(const char c, const scan_class_t class)
+{
+    switch (class)
+    {
+        case SCAN_WHITESPACE: return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        case SCAN_IDENTIFIER: return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        case SCAN_DIGIT:      return c >= '0' && c <= '9';
+        case SCAN_COMMENT:    return c != '\n' && c != '\0';
+        case SCAN_STRING:     return c != '"' && c != '\0';
+        default:
+            UNREACHABLE;
+            return false;
+    }
+}
+
+static const char *scan_scalar(const char *p, const scan_class_t class, size_t *newlines)
+{
+    for (; in_class(*p, class); ++p)
+        *newlines += *p == '\n';
+
+    return p;
+}
+
+#if CLOX_SCAN_SIMD
+
+// Both versions go through aligned blocks: an aligned load never crosses a page, so
+// the bytes read past the terminator (or before `p`, which are masked) are harmless.
+// They are outside the buffer all the same, the loads aren't instrumented by the
+// address sanitizer. Ranges are compared as signed bytes, non-ASCII characters are
+// negative and fall out.
+
+#define SCAN_BLOCK(width, mask_t, load, classify)                                            \
+    do                                                                                       \
+    {                                                                                        \
+        size_t offset = (uintptr_t)p & ((width) - 1);                                        \
+        const char *block = p - offset;                                                      \
+        mask_t before = (mask_t)(((mask_t)1 << offset) - 1);                                 \
+                                                                                             \
+        while (true)                                                                         \
+        {                                                                                    \
+            mask_t lines;                                                                    \
+            mask_t in = classify(load(block), class, &lines) | before;                       \
+            lines &= (mask_t)~before;                                                        \
+                                                                                             \
+            if (in != (mask_t)~(mask_t)0)                                                    \
+            {                                                                                \
+                unsigned end = (unsigned)__builtin_ctz((mask_t)~in);                         \
+                *newlines += (size_t)__builtin_popcount(lines & (mask_t)(((mask_t)1 << end) - 1)); \
+                return block + end;                                                          \
+            }                                                                                \
+                                                                                             \
+            *newlines += (size_t)__builtin_popcount(lines);                                  \
+            block += (width);                                                                \
+            before = 0;                                                                      \
+        }                                                                                    \
+    } while (0)
+
+__attribute__((no_sanitize_address))
+static inline __m128i load_sse2(const char *block)
+{
+    return _mm_load_si128((const __m128i *)(const void *)block);
+}
+
+static inline uint16_t classify_sse2(const __m128i v, const scan_class_t class, uint16_t *lines)
+{
+#define EQ(c)             _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define RANGE(x, lo, hi)  _mm_and_si128(_mm_cmpgt_epi8((x), _mm_set1_epi8((lo) - 1)), \
+                                        _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), (x)))
+#define MASK(m)           ((uint16_t)_mm_movemask_epi8(m))
+
+    *lines = MASK(EQ('\n'));
+
+    switch (class)
+    {
+        case SCAN_WHITESPACE: return MASK(_mm_or_si128(_mm_or_si128(EQ(' '), EQ('\t')), EQ('\r'))) | *lines;
+        case SCAN_IDENTIFIER:
+            return MASK(_mm_or_si128(_mm_or_si128(RANGE(v, '0', '9'), EQ('_')),
+                                     RANGE(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z')));
+        case SCAN_DIGIT:      return MASK(RANGE(v, '0', '9'));
+        case SCAN_COMMENT:    return (uint16_t)~(*lines | MASK(EQ('\0')));
+        case SCAN_STRING:     return (uint16_t)~(MASK(EQ('"')) | MASK(EQ('\0')));
+        default:
+            UNREACHABLE;
+            return 0;
+    }
+
+#undef MASK
+#undef RANGE
+#undef EQ
+}
+
+static const char *scan_sse2(const char *p, const scan_class_t class, size_t *newlines)
+{
+    SCAN_BLOCK(16, uint16_t, load_sse2, classify_sse2);
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static inline __m256i load_avx2(const char *block)
+{
+    return _mm256_load_si256((const __m256i *)(const void *)block);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t classify_avx2(const __m256i v, const scan_class_t class, uint32_t *lines)
+{
+#define EQ(c)             _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define RANGE(x, lo, hi)  _mm256_and_si256(_mm256_cmpgt_epi8((x), _mm256_set1_epi8((lo) - 1)), \
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), (x)))
+#define MASK(m)           ((uint32_t)_mm256_movemask_epi8(m))
+
+    *lines = MASK(EQ('\n'));
+
+    switch (class)
+    {
+        case SCAN_WHITESPACE: return MASK(_mm256_or_si256(_mm256_or_si256(EQ(' '), EQ('\t')), EQ('\r'))) | *lines;
+        case SCAN_IDENTIFIER:
+            return MASK(_mm256_or_si256(_mm256_or_si256(RANGE(v, '0', '9'), EQ('_')),
+                                        RANGE(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z')));
+        case SCAN_DIGIT:      return MASK(RANGE(v, '0', '9'));
+        case SCAN_COMMENT:    return ~(*lines | MASK(EQ('\0')));
+        case SCAN_STRING:     return ~(MASK(EQ('"')) | MASK(EQ('\0')));
+        default:
+            UNREACHABLE;
+            return 0;
+    }
+
+#undef MASK
+#undef RANGE
+#undef EQ
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const scan_class_t class, size_t *newlines)
+{
+    SCAN_BLOCK(32, uint32_t, load_avx2, classify_avx2);
+}
+
+#undef SCAN_BLOCK
+
+#endif // CLOX_SCAN_SIMD
+
+static void scan_select(void)
+{
+#if CLOX_SCAN_SIMD
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif // CLOX_SCAN_SIMD
+}
+
+void scan_init(void)
+{
+    pthread_once(&scan_once, scan_select);
+}
+
+const char *scan_run(const char *p, const scan_class_t class, size_t *newlines)
+{
+    return scan(p, class, newlines);
+}
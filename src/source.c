@@ -0,0 +1,253 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <errno.h>
+#include "source.h"
+#include "memory.h"
+#include "tokenizer.h"
+
+#if CLOX_SOURCE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // CLOX_SOURCE_MMAP
+
+#ifndef CLOX_SOURCE_READ_SIZE
+#define CLOX_SOURCE_READ_SIZE 4096
+#endif // CLOX_SOURCE_READ_SIZE
+
+static int source_read(source_t *source, FILE *file)
+{
+    size_t capacity = CLOX_SOURCE_READ_SIZE;
+    char *data = (char *)memory_allocate(NULL, capacity + 1, false);
+    size_t length = 0;
+
+    while (true)
+    {
+        length += fread(data + length, sizeof(char), capacity - length, file);
+        if (length < capacity)
+            break;
+
+        capacity *= 2;
+        data = (char *)memory_allocate(data, capacity + 1, false);
+    }
+
+    if (ferror(file))
+    {
+        memory_free(data);
+        return EIO;
+    }
+
+    data[length] = '\0';
+    *source = (source_t){.data = data, .length = length, .mapped = 0};
+    return 0;
+}
+
+#if CLOX_SOURCE_MMAP
+// The file is mapped over a zeroed anonymous mapping rounded up to the next page (a
+// whole extra page when the size is a multiple of it), so there always is a '\0' after
+// the text and reading up to the end of its page is valid
+static bool source_map(source_t *source, int fd, size_t length)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = (length / page + 1) * page;
+
+    char *data = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    if (length > 0 && mmap(data, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(data, mapped);
+        return false;
+    }
+
+    *source = (source_t){.data = data, .length = length, .mapped = mapped};
+    return true;
+}
+#endif // CLOX_SOURCE_MMAP
+
+int source_open(source_t *source, const char *filename)
+{
+    *source = (source_t){0};
+
+#if CLOX_SOURCE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return errno;
+
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) < 0)
+    {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+
+    if (S_ISREG(stat_buffer.st_mode) && source_map(source, fd, (size_t)stat_buffer.st_size))
+    {
+        close(fd);
+        return 0;
+    }
+
+    FILE *file = fdopen(fd, "rb");
+    if (file == NULL)
+    {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+#else
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return errno;
+#endif // CLOX_SOURCE_MMAP
+
+    int error = source_read(source, file);
+    fclose(file);
+    return error;
+}
+
+void source_close(source_t *source)
+{
+#if CLOX_SOURCE_MMAP
+    if (source->mapped > 0)
+        munmap((void *)(uintptr_t)source->data, source->mapped);
+    else
+#endif // CLOX_SOURCE_MMAP
+        memory_free((void *)(uintptr_t)source->data);
+
+    *source = (source_t){0};
+}
+
+void source_stream_init(source_stream_t *stream, FILE *file)
+{
+    *stream = (source_stream_t){.file = file, .capacity = CLOX_SOURCE_WINDOW, .line = 1};
+    stream->buffer = (char *)memory_allocate(NULL, stream->capacity + 1, false);
+    stream->buffer[0] = '\0';
+}
+
+void source_stream_free(source_stream_t *stream)
+{
+    memory_free(stream->buffer);
+    *stream = (source_stream_t){0};
+}
+
+// Drops the declarations already handed out and reads the next window
+static bool source_stream_fill(source_stream_t *stream)
+{
+    memmove(stream->buffer, stream->buffer + stream->start, stream->length - stream->start);
+    stream->length -= stream->start;
+    stream->scan -= stream->start;
+    stream->start = 0;
+
+    if (stream->length + CLOX_SOURCE_WINDOW > stream->capacity)
+    {
+        stream->capacity *= 2;
+        stream->buffer = (char *)memory_allocate(stream->buffer, stream->capacity + 1, false);
+    }
+
+    errno = 0;
+    size_t read = fread(stream->buffer + stream->length, sizeof(char), CLOX_SOURCE_WINDOW, stream->file);
+    stream->length += read;
+    stream->buffer[stream->length] = '\0';
+
+    if (read < CLOX_SOURCE_WINDOW)
+    {
+        stream->eof = true;
+        if (ferror(stream->file))
+        {
+            stream->error = errno != 0 ? errno : EIO;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A declaration ends with a ';' or a '}' outside of any parentheses or braces, unless
+// an 'else' follows. A token that reaches the end of the buffer may be cut, so it is
+// scanned again once the next window is read.
+const char *source_stream_next(source_stream_t *stream)
+{
+    if (stream->end > 0)
+    {
+        for (size_t i = stream->start; i < stream->end; ++i)
+            stream->line += stream->buffer[i] == '\n';
+
+        stream->buffer[stream->end] = stream->saved;
+        stream->start = stream->scan = stream->end;
+        stream->depth = 0;
+        stream->end = 0;
+    }
+
+    while (true)
+    {
+        tokenizer_t tokenizer;
+        tokenizer_init(&tokenizer, stream->buffer + stream->scan);
+
+        size_t depth = stream->depth;
+        size_t candidate = 0;
+        bool found = false;
+
+        while (!found)
+        {
+            token_t token = tokenizer_next(&tokenizer);
+            size_t token_end = (size_t)(token.start - stream->buffer) + token.length;
+
+            if ((token.type == TOKEN_EOF || token_end >= stream->length) && !stream->eof)
+                break;
+
+            if (candidate > 0 && token.type != TOKEN_ELSE)
+            {
+                stream->end = candidate;
+                found = true;
+                continue;
+            }
+
+            if (token.type == TOKEN_EOF)
+            {
+                stream->end = stream->length;
+                found = true;
+                continue;
+            }
+
+            switch (token.type)
+            {
+                case TOKEN_LEFT_PAREN:
+                case TOKEN_LEFT_BRACE:  { depth++; } break;
+                case TOKEN_RIGHT_PAREN:
+                case TOKEN_RIGHT_BRACE: { depth -= depth > 0; } break;
+                default: {}
+            }
+
+            candidate = 0;
+            if (depth == 0 && (token.type == TOKEN_SEMICOLON || token.type == TOKEN_RIGHT_BRACE))
+                candidate = token_end;
+            else
+            {
+                stream->scan = token_end;
+                stream->depth = depth;
+            }
+        }
+
+        if (found)
+            break;
+
+        if (!source_stream_fill(stream))
+            return NULL;
+    }
+
+    // Only whitespace and comments were left
+    tokenizer_t tokenizer;
+    tokenizer_init(&tokenizer, stream->buffer + stream->start);
+    if (tokenizer_next(&tokenizer).type == TOKEN_EOF && stream->end == stream->length)
+    {
+        stream->end = 0;
+        stream->start = stream->scan = stream->length;
+        return NULL;
+    }
+
+    stream->saved = stream->buffer[stream->end];
+    stream->buffer[stream->end] = '\0';
+    return stream->buffer + stream->start;
+}
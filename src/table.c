@@ -5,22 +5,12 @@ static bool table_entry_empty(const entry_t *entry)
     return entry->key == NULL;
 }
 
+// Deleted entries are empty with a true value, probing goes on past them
 static bool table_entry_deleted(const entry_t *entry)
 {
     return table_entry_empty(entry) && entry->value.type != VAL_NIL;
 }
 
-static uint32_t table_hash(const entry_key_t key)
-{
-    uint32_t hash = 2166136261u;
-    for (size_t i = 0; i < key->length; ++i)
-    {
-        hash ^= (uint8_t)key->data[i];
-        hash *= 16777619;
-    }
-    return hash;
-}
-
 void table_move(table_t *to, entry_t *from, const size_t n)
 {
     entry_t *entry;
@@ -37,29 +27,42 @@ void table_move(table_t *to, entry_t *from, const size_t n)
 
 void table_expand(table_t *table, const size_t capacity)
 {
-    assert(table->capacity < capacity && "Not allowed to shrink table");
+    assert(table->capacity <= capacity && "Not allowed to shrink table");
+    assert((capacity & (capacity - 1)) == 0 && "Capacity must be a power of two");
 
     if (capacity > 0)
     {
         entry_t *old_entries = table->entries;
-        table->entries = (entry_t *)memory_allocate(table->entries, GROW_CAPACITY(capacity * sizeof(entry_t)), true);
-        table_move(table, old_entries, table->capacity);
+        size_t old_capacity = table->capacity;
+
+        if (old_capacity > 0 && capacity > old_capacity)
+            memory_count_growth();
+
+        // Entries are hashed again modulo the capacity and counted again, and the
+        // deleted ones are dropped: at the same capacity that's the point, deleted
+        // entries would otherwise fill the table up. They're inserted into a new
+        // zeroed block since their slots change, the old one is read from as they go
+        table->entries = (entry_t *)memory_allocate(NULL, capacity * sizeof(entry_t), true);
         table->capacity = capacity;
+        table->count = 0;
+        table->live = 0;
+        table_move(table, old_entries, old_capacity);
     }
 }
 
 void table_init(table_t *table)
 {
     table->count = 0;
+    table->live = 0;
     table->capacity = 0;
     table->entries = NULL;
 
-    table_expand(table, 10);
+    table_expand(table, CLOX_TABLE_MIN);
 }
 
 entry_t *table_entry_get(const table_t *table, const entry_key_t key)
 {
-    entry_hash_t hash = table_hash(key) % table->capacity;
+    entry_hash_t hash = key->hash & (entry_hash_t)(table->capacity - 1);
     entry_t *deleted = NULL;
     entry_t *entry;
 
@@ -72,21 +75,54 @@ entry_t *table_entry_get(const table_t *table, const entry_key_t key)
                 deleted = entry;
             else
                 return deleted == NULL ? entry : deleted;
-        else if (object_string_cmp(key, entry->key))
+        else if (entry->key == key)
+            return entry;
+
+        hash = (hash + 1) & (entry_hash_t)(table->capacity - 1);
+    }
+}
+
+entry_t *table_find_string(const table_t *table, const char *data, const size_t length, const entry_hash_t hash)
+{
+    entry_hash_t index = hash & (entry_hash_t)(table->capacity - 1);
+    entry_t *entry;
+
+    while (1)
+    {
+        entry = &table->entries[index];
+
+        if (table_entry_empty(entry))
+        {
+            if (!table_entry_deleted(entry))
+                return NULL;
+        }
+        else if (entry->key->hash == hash && entry->key->length == length &&
+                 memcmp(entry->key->data, data, length) == 0)
+        {
             return entry;
+        }
 
-        hash = (hash + 1) % table->capacity;
+        index = (index + 1) & (entry_hash_t)(table->capacity - 1);
     }
 }
 
 bool table_entry_set(table_t *table, const entry_key_t key, const value_t value)
 {
+    // Probing needs a free entry to stop at, the table never fills up. When deleted
+    // entries take most of the slots they are dropped rather than doubling, a set
+    // churning through keys would grow without bounds otherwise
+    if ((table->count + 1) * 4 > table->capacity * 3)
+        table_expand(table, (table->live + 1) * 2 <= table->capacity ? table->capacity : GROW_CAPACITY(table->capacity));
+
     entry_t *entry = table_entry_get(table, key);
     if (table_entry_empty(entry))
     {
+        // A deleted entry is already counted
+        if (!table_entry_deleted(entry))
+            table->count++;
+        table->live++;
         entry->key = key;
         entry->value = value;
-        table->count++;
         return true;
     }
 
@@ -96,14 +132,14 @@ bool table_entry_set(table_t *table, const entry_key_t key, const value_t value)
 
 bool table_entry_delete(table_t *table, const entry_key_t key)
 {
-    entry_t *entry;
-    if ((entry = table_entry_get(table, key)) == NULL)
+    entry_t *entry = table_entry_get(table, key);
+    if (table_entry_empty(entry))
         return false;
 
-    object_string_destroy(entry->key);
+    // Still counted, so that probing always finds a free entry to stop at
     entry->key = NULL;
-    entry->value = NIL_VAL;
-    table->count--;
+    entry->value = BOOL_VAL(true);
+    table->live--;
 
     return true;
 }
@@ -111,7 +147,10 @@ bool table_entry_delete(table_t *table, const entry_key_t key)
 void table_free(table_t *table)
 {
     memory_free(table->entries);
-    table_init(table);
+    table->entries = NULL;
+    table->count = 0;
+    table->live = 0;
+    table->capacity = 0;
 }
 
 void table_print(const table_t *table)
@@ -1,4 +1,12 @@
+#define _DEFAULT_SOURCE // sysconf(_SC_NPROCESSORS_ONLN)
 #include "tokenizer.h"
+#include "scan.h"
+#include "memory.h"
+
+#if CLOX_TOKENIZE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif // CLOX_TOKENIZE_THREADS
 
 static token_t token(tokenizer_t *tokenizer, const token_type_t type)
 {
@@ -34,69 +42,97 @@ static bool is_alpha(const char c)
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static bool is_alpha_numeric(const char c)
+static token_type_t check_keyword(const char *name, const size_t length,
+                                  const char *keyword, const size_t keyword_length, const token_type_t type)
 {
-    return is_digit(c) || is_alpha(c);
+    if (length == keyword_length && memcmp(name, keyword, length) == 0)
+        return type;
+
+    return TOKEN_IDENTIFIER;
 }
 
-static token_type_t keyword(const char* name)
+// Works on the source span: dispatches on the first character, then compares the rest
+// of the only keyword(s) it can be
+static token_type_t keyword(const char *name, const size_t length)
 {
-    if (strcmp(name, "and") == 0) return TOKEN_AND;
-    if (strcmp(name, "class") == 0) return TOKEN_CLASS;
-    if (strcmp(name, "else") == 0) return TOKEN_ELSE;
-    if (strcmp(name, "false") == 0) return TOKEN_FALSE;
-    if (strcmp(name, "for") == 0) return TOKEN_FOR;
-    if (strcmp(name, "fun") == 0) return TOKEN_FUN;
-    if (strcmp(name, "if") == 0) return TOKEN_IF;
-    if (strcmp(name, "nil") == 0) return TOKEN_NIL;
-    if (strcmp(name, "or") == 0) return TOKEN_OR;
-    if (strcmp(name, "print") == 0) return TOKEN_PRINT;
-    if (strcmp(name, "return") == 0) return TOKEN_RETURN;
-    if (strcmp(name, "super") == 0) return TOKEN_SUPER;
-    if (strcmp(name, "this") == 0) return TOKEN_THIS;
-    if (strcmp(name, "true") == 0) return TOKEN_TRUE;
-    if (strcmp(name, "var") == 0) return TOKEN_VAR;
-    if (strcmp(name, "while") == 0) return TOKEN_WHILE;
-
-    return TOKEN_ERROR;
+    switch (name[0])
+    {
+        case 'a': return check_keyword(name, length, "and", 3, TOKEN_AND);
+        case 'c':
+            {
+                if (length == 5 && name[1] == 'l')
+                    return check_keyword(name, length, "class", 5, TOKEN_CLASS);
+                return check_keyword(name, length, "const", 5, TOKEN_CONST);
+            }
+        case 'e': return check_keyword(name, length, "else", 4, TOKEN_ELSE);
+        case 'f':
+            {
+                if (length == 3 && name[1] == 'o')
+                    return check_keyword(name, length, "for", 3, TOKEN_FOR);
+                if (length == 3)
+                    return check_keyword(name, length, "fun", 3, TOKEN_FUN);
+                return check_keyword(name, length, "false", 5, TOKEN_FALSE);
+            }
+        case 'i':
+            {
+                if (length == 6)
+                    return check_keyword(name, length, "import", 6, TOKEN_IMPORT);
+                return check_keyword(name, length, "if", 2, TOKEN_IF);
+            }
+        case 'n': return check_keyword(name, length, "nil", 3, TOKEN_NIL);
+        case 'o': return check_keyword(name, length, "or", 2, TOKEN_OR);
+        case 'p': return check_keyword(name, length, "print", 5, TOKEN_PRINT);
+        case 'r': return check_keyword(name, length, "return", 6, TOKEN_RETURN);
+        case 's': return check_keyword(name, length, "super", 5, TOKEN_SUPER);
+        case 't':
+            {
+                if (length == 4 && name[1] == 'h')
+                    return check_keyword(name, length, "this", 4, TOKEN_THIS);
+                return check_keyword(name, length, "true", 4, TOKEN_TRUE);
+            }
+        case 'v': return check_keyword(name, length, "var", 3, TOKEN_VAR);
+        case 'w': return check_keyword(name, length, "while", 5, TOKEN_WHILE);
+        default:  return TOKEN_IDENTIFIER;
+    }
 }
 
 static token_t number(tokenizer_t *tokenizer)
 {
-    while (is_digit(*tokenizer->current)) { tokenizer->current++; }
+    tokenizer->current = scan_run(tokenizer->current, SCAN_DIGIT, &tokenizer->line);
     return token(tokenizer, TOKEN_NUMBER);
 }
 
 static token_t identifier(tokenizer_t *tokenizer)
 {
-    while (is_alpha_numeric(*tokenizer->current)) { tokenizer->current++; }
+    tokenizer->current = scan_run(tokenizer->current, SCAN_IDENTIFIER, &tokenizer->line);
 
-    char name[tokenizer->current - tokenizer->start];
-    strncpy(name, tokenizer->start, (size_t)(tokenizer->current - tokenizer->start + 1));
-    name[tokenizer->current - tokenizer->start] = '\0';
+    return token(tokenizer, keyword(tokenizer->start, (size_t)(tokenizer->current - tokenizer->start)));
+}
 
-    token_type_t kw = keyword(name);
-    if (kw != TOKEN_ERROR)
-    {
-        return token(tokenizer, kw);
-    }
+static token_t string(tokenizer_t *tokenizer)
+{
+    tokenizer->current = scan_run(tokenizer->current, SCAN_STRING, &tokenizer->line);
+
+    if (advance_if_equals(tokenizer, '"'))
+        return token(tokenizer, TOKEN_STRING);
 
-    return token(tokenizer, TOKEN_IDENTIFIER);
+    return token(tokenizer, TOKEN_ERROR);
 }
 
-static token_t string(tokenizer_t *tokenizer)
+// Whitespace and comments, the next token starts after them
+static void skip(tokenizer_t *tokenizer)
 {
-    while (*tokenizer->current != '\0')
+    while (true)
     {
-        if (advance_if_equals(tokenizer, '"'))
-        {
-            return token(tokenizer, TOKEN_STRING);
-        }
+        tokenizer->current = scan_run(tokenizer->current, SCAN_WHITESPACE, &tokenizer->line);
 
-        tokenizer->current++;
+        if (tokenizer->current[0] != '/' || tokenizer->current[1] != '/')
+            break;
+
+        tokenizer->current = scan_run(tokenizer->current + 2, SCAN_COMMENT, &tokenizer->line);
     }
 
-    return token(tokenizer, TOKEN_ERROR);
+    tokenizer->start = tokenizer->current;
 }
 
 void tokenizer_init(tokenizer_t *tokenizer, const char *source)
@@ -104,6 +140,8 @@ void tokenizer_init(tokenizer_t *tokenizer, const char *source)
     tokenizer->start = source;
     tokenizer->current = source;
     tokenizer->line = 1;
+
+    scan_init();
 }
 
 const char* tokenizer_token_name(const token_type_t type)
@@ -137,11 +175,13 @@ const char* tokenizer_token_name(const token_type_t type)
         case TOKEN_NUMBER:        { return "Number"; }
         case TOKEN_AND:           { return "and"; }
         case TOKEN_CLASS:         { return "class"; }
+        case TOKEN_CONST:         { return "const"; }
         case TOKEN_ELSE:          { return "else"; }
         case TOKEN_FALSE:         { return "false"; }
         case TOKEN_FOR:           { return "for"; }
         case TOKEN_FUN:           { return "fun"; }
         case TOKEN_IF:            { return "if"; }
+        case TOKEN_IMPORT:        { return "import"; }
         case TOKEN_NIL:           { return "nil"; }
         case TOKEN_OR:            { return "or"; }
         case TOKEN_PRINT:         { return "print"; }
@@ -162,71 +202,315 @@ bool tokenizer_token_cmp(const token_t a, const token_t b)
     return a.length == b.length && strncmp(a.start, b.start, a.length) == 0;
 }
 
+uint32_t tokenizer_token_hash(const token_t token)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < token.length; ++i)
+    {
+        hash ^= (uint8_t)token.start[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
 token_t tokenizer_next(tokenizer_t *tokenizer)
 {
-    while (true)
+    skip(tokenizer);
+
+    const char c = *tokenizer->current++;
+
+    switch (c)
     {
-        const char c = *tokenizer->current++;
+        case '\0':
+            {
+                tokenizer->current--; // Stays on the terminator
+                return token(tokenizer, TOKEN_EOF);
+            }
 
-        switch (c)
+        case '(': { return token(tokenizer, TOKEN_LEFT_PAREN); }
+        case ')': { return token(tokenizer, TOKEN_RIGHT_PAREN); }
+        case '{': { return token(tokenizer, TOKEN_LEFT_BRACE); }
+        case '}': { return token(tokenizer, TOKEN_RIGHT_BRACE); }
+        case ',': { return token(tokenizer, TOKEN_COMMA); }
+        case '.': { return token(tokenizer, TOKEN_DOT); }
+        case '-': { return token(tokenizer, TOKEN_MINUS); }
+        case '+': { return token(tokenizer, TOKEN_PLUS); }
+        case ';': { return token(tokenizer, TOKEN_SEMICOLON); }
+        case '*': { return token(tokenizer, TOKEN_STAR); }
+
+        case '/': { return token(tokenizer, TOKEN_SLASH); }
+
+        case '!': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG ); }
+        case '=': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL); }
+        case '<': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER); }
+        case '>': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS); }
+
+        default:
         {
-            case '\0': { return token(tokenizer, TOKEN_EOF); }
+            if (is_digit(c))
+            {
+                return number(tokenizer);
+            }
 
-            case '\n':
-                tokenizer->line++;
-                continue;
-            case ' ':
-            case '\t':
-            case '\r':
-                tokenizer->start++;
+            if (is_alpha(c))
+            {
+                return identifier(tokenizer);
+            }
+
+            if (c == '"')
+            {
+                return string(tokenizer);
+            }
+
+            return token(tokenizer, TOKEN_ERROR);
+        }
+    }
+}
+
+static void token_stream_grow(token_stream_t *stream)
+{
+    size_t capacity = GROW_CAPACITY(stream->capacity);
+    memory_count_growth();
+
+#define GROW(field) stream->field = memory_allocate(stream->field, capacity * sizeof(*stream->field), false)
+
+    GROW(types);
+    GROW(offsets);
+    GROW(lengths);
+    GROW(lines);
+
+#undef GROW
+
+    stream->capacity = capacity;
+}
+
+static void token_stream_push(token_stream_t *stream, const token_t token, const size_t line_base)
+{
+    if (stream->count >= stream->capacity)
+        token_stream_grow(stream);
+
+    stream->types[stream->count] = (uint8_t)token.type;
+    stream->offsets[stream->count] = (uint32_t)(token.start - stream->source);
+    stream->lengths[stream->count] = (uint32_t)token.length;
+    stream->lines[stream->count] = (uint32_t)(token.line + line_base);
+    stream->count++;
+}
+
+// Pushes the tokens starting before end, returns the offset where the last one ends
+static size_t token_stream_lex(token_stream_t *stream, tokenizer_t *tokenizer, const char *end)
+{
+    size_t stop = (size_t)(tokenizer->current - stream->source);
+
+    while (true)
+    {
+        const token_t token = tokenizer_next(tokenizer);
+        if (token.start >= end)
+            break;
+
+        token_stream_push(stream, token, 0);
+        stop = (size_t)(token.start + token.length - stream->source);
+
+        if (token.type == TOKEN_EOF)
+            break;
+    }
+
+    return stop;
+}
+
+#if CLOX_TOKENIZE_THREADS
+
+// The source is split at line starts, where no comment can be open, and every chunk is
+// lexed on its own thread as if no string were open either. Stitching the chunks in
+// order checks that speculation: a chunk is kept when the tokens before it end at or
+// before its start, otherwise it is lexed again from where they end.
+typedef struct token_chunk
+{
+    token_stream_t stream;
+    const char *start;
+    const char *end;
+    size_t stop;
+    pthread_t thread;
+    bool threaded;
+} token_chunk_t;
+
+static void *token_chunk_lex(void *arg)
+{
+    token_chunk_t *chunk = (token_chunk_t *)arg;
+
+    // Not tokenizer_init, the scanner was set up by the calling thread
+    tokenizer_t tokenizer = {.start = chunk->start, .current = chunk->start, .line = 1};
+    chunk->stop = token_stream_lex(&chunk->stream, &tokenizer, chunk->end);
+
+    return NULL;
+}
+
+static size_t token_stream_threads(size_t threads, const size_t length)
+{
+    if (threads == 0)
+    {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+
+    if (threads > CLOX_TOKENIZE_THREADS_MAX)
+        threads = CLOX_TOKENIZE_THREADS_MAX;
+
+    if (threads > length / CLOX_TOKENIZE_CHUNK_MIN)
+        threads = length / CLOX_TOKENIZE_CHUNK_MIN;
+
+    return threads;
+}
+
+static size_t count_lines(const char *from, const char *to)
+{
+    size_t lines = 0;
+    while (from < to && (from = memchr(from, '\n', (size_t)(to - from))) != NULL)
+    {
+        lines++;
+        from++;
+    }
+    return lines;
+}
+
+static bool token_stream_build_parallel(token_stream_t *stream, tokenizer_t *tokenizer, size_t threads)
+{
+    const char *source = tokenizer->current;
+    const size_t length = strlen(source);
+
+    threads = token_stream_threads(threads, length);
+    if (threads < 2)
+        return false;
+
+    token_chunk_t chunks[CLOX_TOKENIZE_THREADS_MAX];
+    size_t count = 0;
+
+    const char *start = source;
+    for (size_t i = 1; i <= threads; ++i)
+    {
+        const char *end = source + length + 1; // The last chunk takes the TOKEN_EOF
+        if (i < threads)
+        {
+            end = memchr(source + length / threads * i, '\n', length - length / threads * i);
+            if (end == NULL)
                 continue;
+            end++;
+        }
 
-            case '(': { return token(tokenizer, TOKEN_LEFT_PAREN); }
-            case ')': { return token(tokenizer, TOKEN_RIGHT_PAREN); }
-            case '{': { return token(tokenizer, TOKEN_LEFT_BRACE); }
-            case '}': { return token(tokenizer, TOKEN_RIGHT_BRACE); }
-            case ',': { return token(tokenizer, TOKEN_COMMA); }
-            case '.': { return token(tokenizer, TOKEN_DOT); }
-            case '-': { return token(tokenizer, TOKEN_MINUS); }
-            case '+': { return token(tokenizer, TOKEN_PLUS); }
-            case ';': { return token(tokenizer, TOKEN_SEMICOLON); }
-            case '*': { return token(tokenizer, TOKEN_STAR); }
-
-            case '/':
-                {
-                    if (advance_if_equals(tokenizer, '/'))
-                    {
-                        while (*tokenizer->current != '\0' && *tokenizer->current != '\n') { tokenizer->current++; }
-                        continue;
-                    }
-
-                    return token(tokenizer, TOKEN_SLASH);
-                }
-
-            case '!': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG ); }
-            case '=': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL); }
-            case '<': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER); }
-            case '>': { return token(tokenizer, advance_if_equals(tokenizer, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS); }
-
-            default:
+        if (end <= start)
+            continue;
+
+        chunks[count++] = (token_chunk_t){.stream = {.source = source}, .start = start, .end = end};
+        start = end;
+    }
+
+    // The calling thread takes the first chunk, and any a worker couldn't be started for
+    for (size_t i = 1; i < count; ++i)
+        chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, token_chunk_lex, &chunks[i]) == 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!chunks[i].threaded)
+            token_chunk_lex(&chunks[i]);
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (chunks[i].threaded)
+            pthread_join(chunks[i].thread, NULL);
+        total += chunks[i].stream.count;
+    }
+
+    *stream = (token_stream_t){.source = source};
+    while (stream->capacity < total)
+        stream->capacity = GROW_CAPACITY(stream->capacity);
+    stream->types = memory_allocate(NULL, stream->capacity * sizeof(*stream->types), false);
+    stream->offsets = memory_allocate(NULL, stream->capacity * sizeof(*stream->offsets), false);
+    stream->lengths = memory_allocate(NULL, stream->capacity * sizeof(*stream->lengths), false);
+    stream->lines = memory_allocate(NULL, stream->capacity * sizeof(*stream->lines), false);
+
+    // Where the serial tokenizer would resume, and its line there
+    size_t resume = 0;
+    size_t line = tokenizer->line;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        token_chunk_t *chunk = &chunks[i];
+        const size_t offset = (size_t)(chunk->start - source);
+
+        if (resume <= offset)
+        {
+            const size_t line_base = line + count_lines(source + resume, chunk->start) - 1;
+            for (size_t j = 0; j < chunk->stream.count; ++j)
+                token_stream_push(stream, token_stream_get(&chunk->stream, j), line_base);
+
+            if (chunk->stream.count > 0)
             {
-                if (is_digit(c))
-                {
-                    return number(tokenizer);
-                }
-
-                if (is_alpha(c))
-                {
-                    return identifier(tokenizer);
-                }
-
-                if (c == '"')
-                {
-                    return string(tokenizer);
-                }
-
-                return token(tokenizer, TOKEN_ERROR);
+                resume = chunk->stop;
+                line = stream->lines[stream->count - 1];
             }
         }
+        else if (resume < (size_t)(chunk->end - source))
+        {
+            // A token of the previous chunks runs into this one
+            tokenizer_t relex = {.start = source + resume, .current = source + resume, .line = line};
+            const size_t count_before = stream->count;
+            resume = token_stream_lex(stream, &relex, chunk->end);
+            if (stream->count > count_before)
+                line = stream->lines[stream->count - 1];
+        }
+
+        token_stream_free(&chunk->stream);
     }
+
+    tokenizer->start = tokenizer->current = source + resume;
+    tokenizer->line = line;
+
+    return true;
+}
+
+#endif // CLOX_TOKENIZE_THREADS
+
+// Runs the tokenizer to the end, the last token is TOKEN_EOF. Large sources are split
+// over up to threads workers, 0 meaning one per core. False leaves the stream empty
+// and the tokenizer untouched.
+bool token_stream_build(token_stream_t *stream, tokenizer_t *tokenizer, size_t threads)
+{
+    *stream = (token_stream_t){.source = tokenizer->start};
+
+    const size_t length = strlen(tokenizer->start);
+    if (length >= UINT32_MAX)
+        return false;
+
+#if CLOX_TOKENIZE_THREADS
+    if (threads != 1 && token_stream_build_parallel(stream, tokenizer, threads))
+        return true;
+#else
+    (void)threads;
+#endif // CLOX_TOKENIZE_THREADS
+
+    token_stream_lex(stream, tokenizer, tokenizer->start + length + 1);
+    return true;
+}
+
+void token_stream_free(token_stream_t *stream)
+{
+    memory_free(stream->types);
+    memory_free(stream->offsets);
+    memory_free(stream->lengths);
+    memory_free(stream->lines);
+    *stream = (token_stream_t){0};
+}
+
+// Past the end it keeps returning the TOKEN_EOF
+token_t token_stream_get(const token_stream_t *stream, size_t index)
+{
+    if (index >= stream->count)
+        index = stream->count - 1;
+
+    return (token_t){
+        .type = (token_type_t)stream->types[index],
+        .start = stream->source + stream->offsets[index],
+        .length = stream->lengths[index],
+        .line = stream->lines[index]};
 }
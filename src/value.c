@@ -24,7 +24,7 @@ cmp_t value_cmp(value_t a, value_t b)
 
 bool value_addable(const value_t a, const value_t b)
 {
-    return a.type == b.type && (IS_NUMBER(a) || IS_STRING(a));
+    return a.type == b.type && (IS_NUMBER(a) || (IS_TEXT(a) && IS_TEXT(b)));
 }
 
 value_t value_add(value_t a, value_t b)
@@ -34,7 +34,7 @@ value_t value_add(value_t a, value_t b)
     case VAL_NUMBER:
         return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
     case VAL_OBJECT:
-        return OBJECT_VAL(object_string_concat(AS_STRING(a), AS_STRING(b)));
+        return OBJECT_VAL(object_concat(AS_OBJECT(a), AS_OBJECT(b)));
     default:
         UNREACHABLE;
     }
@@ -75,6 +75,12 @@ value_t value_stack_top(value_stack_t *stack)
 
 void value_stack_push(value_stack_t *stack, value_t value)
 {
+    if (stack->count >= CLOX_VALUE_STACK_MAX)
+    {
+        fprintf(stderr, "ERROR: Stack overflow\n");
+        exit(1);
+    }
+
     stack->items[stack->count++] = value;
 }
 
@@ -1,4 +1,17 @@
 #include "vm.h"
+#include "image.h"
+#include "source.h"
+#include "gc.h"
+
+static interpret_result_t vm_run(vm_t *, size_t);
+static value_t clk(size_t, value_t *);
+static value_t memstats(size_t, value_t *);
+static value_t builder(size_t, value_t *);
+static value_t append(size_t, value_t *);
+static value_t build(size_t, value_t *);
+
+// Natives aren't given the VM calling them, there is a single one
+static const vm_t *natives_vm = NULL;
 
 static inline bool callable(value_t value)
 {
@@ -12,6 +25,13 @@ static interpret_result_t call(vm_t *vm, value_t value, uint8_t args_count)
     {
     case OBJECT_FUNCTION:
         {
+            object_function_t *function = AS_FUNCTION(value);
+            if (function->source != NULL && compiler_run_function(function, vm->options) != COMPILER_ERROR_NONE)
+            {
+                vm_error(vm, "Couldn't compile function '%.*s'", (int)function->name->length, function->name->data);
+                return INTERPRET_RESULT_COMPILE_ERROR;
+            }
+
             call_frame_t *frame = &vm->frames.items[vm->frames.count++];
             if (vm->frames.count >= CLOX_FRAMES_MAX)
             {
@@ -19,10 +39,10 @@ static interpret_result_t call(vm_t *vm, value_t value, uint8_t args_count)
                 return INTERPRET_RESULT_RUNTIME_ERROR;
             }
 
-            object_function_t *function = AS_FUNCTION(value);
             frame->function = function;
             frame->ip = function->program.chunks.items;
             frame->fp = stack_top;
+            frame->globals = function->globals != NULL ? function->globals : &vm->globals;
         } break;
     case OBJECT_NATIVE:
         {
@@ -41,13 +61,122 @@ static interpret_result_t call(vm_t *vm, value_t value, uint8_t args_count)
 
 static void define_native(vm_t *vm, const char* name, native_fn function)
 {
-    table_entry_set(&vm->globals, object_string_new(name, strlen(name)), OBJECT_VAL(object_native_new(function)));
+    table_entry_set(&vm->builtins, object_string_new(name, strlen(name)), OBJECT_VAL(object_native_new(function)));
+}
+
+// Functions of a module read and define globals in its namespace
+static void bind_globals(object_function_t *function, table_t *globals)
+{
+    function->globals = globals;
+
+    const value_array_t *constants = &function->program.constants;
+    for (size_t i = 0; i < constants->count; ++i)
+    {
+        if (IS_FUNCTION(constants->items[i]))
+            bind_globals(AS_FUNCTION(constants->items[i]), globals);
+    }
+}
+
+// Runs the function on top of the frames being run, until it returns
+static interpret_result_t run_nested(vm_t *vm, object_function_t *function)
+{
+    size_t base = vm->frames.count;
+
+    value_stack_push(&vm->stack, OBJECT_VAL(function));
+    call(vm, OBJECT_VAL(function), 0);
+
+    return vm_run(vm, base);
+}
+
+static object_function_t *compile_module(vm_t *vm, const object_module_t *module, const source_t *source)
+{
+    // There is no source left to compile lazy bodies from once the module ran
+    compiler_options_t options = *vm->options;
+    options.lazy = false;
+    options.globals = NULL;
+    options.first_line = 0;
+
+    char *path = NULL;
+    uint64_t key = 0;
+    object_function_t *function = NULL;
+
+    if (options.cache)
+    {
+        size_t length = strlen(vm->modules_path) + 1 + module->name->length;
+        char *script = (char *)memory_allocate(NULL, length + 1, false);
+        snprintf(script, length + 1, "%s/%.*s", vm->modules_path, (int)module->name->length, module->name->data);
+
+        path = image_cache_path(script);
+        key = image_cache_key(source->data, source->length, options.pipeline);
+        function = image_cache_load(path, key);
+        memory_free(script);
+    }
+
+    if (function == NULL)
+    {
+        compiler_t compiler;
+        if (compiler_run(&compiler, source->data, &options) == 0)
+        {
+            function = compiler.context->function;
+            compiler_free(&compiler);
+            if (path != NULL)
+                image_cache_save(path, function, key);
+        }
+    }
+
+    memory_free(path);
+    return function;
+}
+
+// Marked loaded first: a module imported back while it runs shows the members it
+// has defined so far
+static interpret_result_t load_module(vm_t *vm, object_module_t *module)
+{
+    module->loaded = true;
+
+    size_t length = strlen(vm->modules_path) + 1 + module->name->length + 4;
+    char *path = (char *)memory_allocate(NULL, length + 1, false);
+    snprintf(path, length + 1, "%s/%.*s.lox", vm->modules_path, (int)module->name->length, module->name->data);
+
+    source_t source;
+    int ret = source_open(&source, path);
+    memory_free(path);
+
+    if (ret != 0)
+    {
+        vm_error(vm, "Couldn't read module '%.*s', %s", (int)module->name->length, module->name->data, strerror(ret));
+        return INTERPRET_RESULT_RUNTIME_ERROR;
+    }
+
+    object_function_t *function = compile_module(vm, module, &source);
+    source_close(&source);
+
+    if (function == NULL)
+    {
+        vm_error(vm, "Couldn't compile module '%.*s'", (int)module->name->length, module->name->data);
+        return INTERPRET_RESULT_COMPILE_ERROR;
+    }
+
+    bind_globals(function, module->globals);
+    return run_nested(vm, function);
 }
 
 void vm_init(vm_t *vm)
 {
     value_stack_init(&vm->stack);
     table_init(&vm->globals);
+    table_init(&vm->builtins);
+    table_init(&vm->modules);
+    vm->modules_path = ".";
+    vm->options = NULL;
+    vm->instructions = 0;
+
+    natives_vm = vm;
+    define_native(vm, "clock", clk);
+    define_native(vm, "memstats", memstats);
+    define_native(vm, "builder", builder);
+    define_native(vm, "append", append);
+    define_native(vm, "build", build);
 }
 
 void vm_error(vm_t *vm, const char *fmt, ...)
@@ -72,11 +201,39 @@ void vm_error(vm_t *vm, const char *fmt, ...)
     value_stack_init(&vm->stack);
 }
 
-static interpret_result_t vm_run(vm_t *vm)
+static void collect(vm_t *vm)
+{
+    // Young objects are promoted first, the sweep only sees the old space
+    for (size_t i = 0; i < vm->stack.count; ++i)
+        gc_promote(&vm->stack.items[i]);
+    gc_minor();
+
+    if (!gc_major_pressure())
+        return;
+
+    for (size_t i = 0; i < vm->stack.count; ++i)
+        gc_mark_value(vm->stack.items[i]);
+    for (size_t i = 0; i < vm->frames.count; ++i)
+        gc_mark_object((object_t *)vm->frames.items[i].function);
+
+    gc_mark_table(&vm->globals);
+    gc_mark_table(&vm->builtins);
+    gc_mark_table(&vm->modules);
+
+    // Lazy bodies are compiled against the context of the script being run
+    if (vm->options != NULL)
+        gc_mark_context(vm->options->globals);
+
+    gc_sweep();
+}
+
+// Returns once the frames are back to `base`
+static interpret_result_t vm_run(vm_t *vm, size_t base)
 {
     call_frame_t *frame = &vm->frames.items[vm->frames.count - 1];
 
 #define READ_INSTRUCTION() (*(frame)->ip++)
+#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->function->program.constants.items[READ_INSTRUCTION()])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
 #define BINARY_OP(vm, cast, op)                                                  \
@@ -92,10 +249,18 @@ static interpret_result_t vm_run(vm_t *vm)
         value_stack_push(&vm->stack, cast(AS_NUMBER(left) op AS_NUMBER(right))); \
     } while (0);
 #define PEEK(vm, distance) vm->stack.items[vm->stack.count - distance - 1]
+// Only after the instructions that allocate, with their results on the stack
+#define SAFEPOINT(vm)       \
+    do                      \
+    {                       \
+        if (gc_pressure())  \
+            collect(vm);    \
+    } while (0)
 
     while (true)
     {
         chunk instruction = READ_INSTRUCTION();
+        vm->instructions++;
         switch(instruction)
         {
             case OP_CONSTANT:
@@ -112,41 +277,92 @@ static interpret_result_t vm_run(vm_t *vm)
             case OP_DEFINE_GLOBAL:
                 {
                     object_string_t *name = READ_STRING();
-                    table_entry_set(&vm->globals, name, value_stack_pop(&vm->stack));
+                    value_t value = value_stack_pop(&vm->stack);
+                    gc_barrier(frame->globals, value);
+
+                    // A module's namespace is counted with the module
+                    size_t capacity = frame->globals->capacity;
+                    table_entry_set(frame->globals, name, value);
+                    if (frame->globals != &vm->globals)
+                        gc_grow((frame->globals->capacity - capacity) * sizeof(entry_t));
                 } break;
             case OP_GET_GLOBAL:
                 {
                     object_string_t *name = READ_STRING();
-                    if (table_entry_get(&vm->globals, name)->key == NULL)
+                    entry_t *entry = table_entry_get(frame->globals, name);
+                    if (entry->key == NULL)
+                        entry = table_entry_get(&vm->builtins, name);
+
+                    if (entry->key == NULL)
                     {
                         vm_error(vm, "Used of undefined variable: '%.*s'", (int)name->length, name->data);
                         return INTERPRET_RESULT_RUNTIME_ERROR;
                     }
 
-                    value_stack_push(&vm->stack, table_entry_get(&vm->globals, name)->value);
+                    value_stack_push(&vm->stack, entry->value);
                 } break;
             case OP_SET_GLOBAL:
                 {
                     object_string_t *name = READ_STRING();
-                    if (table_entry_get(&vm->globals, name)->key == NULL)
+                    if (table_entry_get(frame->globals, name)->key == NULL)
                     {
                         vm_error(vm, "Used of undefined variable: '%.*s'", (int)name->length, name->data);
                         return INTERPRET_RESULT_RUNTIME_ERROR;
                     }
-                    table_entry_set(&vm->globals, name, value_stack_top(&vm->stack));
+                    gc_barrier(frame->globals, value_stack_top(&vm->stack));
+                    table_entry_set(frame->globals, name, value_stack_top(&vm->stack));
+                } break;
+
+            case OP_IMPORT:
+                {
+                    object_string_t *name = READ_STRING();
+                    entry_t *entry = table_entry_get(&vm->modules, name);
+                    if (entry->key == NULL)
+                    {
+                        object_module_t *module = object_module_new(name);
+                        table_entry_set(&vm->modules, module->name, OBJECT_VAL(module));
+                        entry = table_entry_get(&vm->modules, name);
+                    }
+
+                    value_stack_push(&vm->stack, entry->value);
+                    SAFEPOINT(vm);
+                } break;
+            case OP_GET_MEMBER:
+                {
+                    object_string_t *name = READ_STRING();
+                    value_t top = value_stack_pop(&vm->stack);
+                    if (!IS_MODULE(top))
+                    {
+                        vm_error(vm, "Only modules have members");
+                        return INTERPRET_RESULT_RUNTIME_ERROR;
+                    }
+
+                    object_module_t *module = AS_MODULE(top);
+                    interpret_result_t result;
+                    if (!module->loaded && (result = load_module(vm, module)) != INTERPRET_RESULT_OK)
+                        return result;
+
+                    entry_t *entry = table_entry_get(module->globals, name);
+                    if (entry->key == NULL)
+                    {
+                        vm_error(vm, "Module '%.*s' has no member '%.*s'", (int)module->name->length, module->name->data,
+                                 (int)name->length, name->data);
+                        return INTERPRET_RESULT_RUNTIME_ERROR;
+                    }
+
+                    value_stack_push(&vm->stack, entry->value);
                 } break;
 
             case OP_GET_LOCAL:
                 {
-                    value_t index_value = READ_CONSTANT();
-                    value_stack_push(&vm->stack, frame->fp[(int)AS_NUMBER(index_value)]);
+                    uint16_t slot = READ_SHORT();
+                    value_stack_push(&vm->stack, frame->fp[slot]);
                 } break;
 
             case OP_SET_LOCAL:
                 {
-                    value_t index_value = READ_CONSTANT();
-                    value_t top = value_stack_pop(&vm->stack);
-                    frame->fp[(int)AS_NUMBER(index_value)] = top;
+                    uint16_t slot = READ_SHORT();
+                    frame->fp[slot] = value_stack_top(&vm->stack);
                 } break;
 
             case OP_ADD:
@@ -161,6 +377,7 @@ static interpret_result_t vm_run(vm_t *vm)
                     }
 
                     value_stack_push(&vm->stack, value_add(right, left));
+                    SAFEPOINT(vm);
                 } break;
             case OP_SUB:   { BINARY_OP(vm, NUMBER_VAL, -); } break;
             case OP_MULTI: { BINARY_OP(vm, NUMBER_VAL, *); } break;
@@ -231,6 +448,32 @@ static interpret_result_t vm_run(vm_t *vm)
                     frame->ip = frame->function->program.chunks.items + ((READ_INSTRUCTION() << 8) | READ_INSTRUCTION());
                 } break;
 
+            case OP_LOOP_LESS:
+            case OP_LOOP_LESS_EQUAL:
+                {
+                    value_t *counter = &frame->fp[READ_SHORT()];
+                    value_t *limit = &frame->fp[READ_SHORT()];
+                    value_t step = READ_CONSTANT();
+                    uint16_t target = READ_SHORT();
+
+                    if (!IS_NUMBER(*counter))
+                    {
+                        vm_error(vm, "Values can't be added");
+                        return INTERPRET_RESULT_RUNTIME_ERROR;
+                    }
+                    *counter = NUMBER_VAL(AS_NUMBER(*counter) + AS_NUMBER(step));
+
+                    if (!IS_NUMBER(*limit))
+                    {
+                        vm_error(vm, "Operands for '+', '-', '*' and '/' must be numbers");
+                        return INTERPRET_RESULT_RUNTIME_ERROR;
+                    }
+
+                    if (instruction == OP_LOOP_LESS ? AS_NUMBER(*counter) < AS_NUMBER(*limit)
+                                                    : AS_NUMBER(*counter) <= AS_NUMBER(*limit))
+                        frame->ip = frame->function->program.chunks.items + target;
+                } break;
+
             case OP_CALL:
                 {
                     uint8_t args_count = READ_INSTRUCTION();
@@ -247,15 +490,15 @@ static interpret_result_t vm_run(vm_t *vm)
                         return result;
 
                     frame = &vm->frames.items[vm->frames.count - 1];
+                    SAFEPOINT(vm);
                 } break;
             case OP_RETURN:
                 {
                     value_t result = value_stack_pop(&vm->stack);
-                    while (!IS_FUNCTION(value_stack_top(&vm->stack)))
-                        value_stack_pop(&vm->stack); // Pops all values after the callee
 
-                    value_stack_pop(&vm->stack); // Pops the callee
-                    if (--vm->frames.count <= 1)
+                    // Pops the callee and everything above it, local functions included
+                    vm->stack.count = (size_t)(frame->fp - vm->stack.items) - 1;
+                    if (--vm->frames.count <= base)
                         return INTERPRET_RESULT_OK;
 
                     value_stack_push(&vm->stack, result); // Pushes the return value
@@ -268,8 +511,10 @@ static interpret_result_t vm_run(vm_t *vm)
 #endif // CLOX_DEBUG_PRINT
     }
 
+#undef SAFEPOINT
 #undef PEEK
 #undef BINARY_OP
+#undef READ_SHORT
 #undef READ_INSTRUCTION
 #undef READ_STRING
 #undef READ_CONSTANT
@@ -281,23 +526,164 @@ static value_t clk(UNUSED size_t args_count, UNUSED value_t *args)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-interpret_result_t vm_interpret(vm_t *vm, object_function_t *function)
+// Counters named like in vm_memory_print, the live objects of a type by its name
+static bool memory_counter(const vm_t *vm, const object_string_t *name, double *counter)
+{
+    memory_stats_t memory = memory_stats();
+    const struct
+    {
+        const char *name;
+        size_t value;
+    } counters[] =
+    {
+        {"bytes", memory.bytes},
+        {"peak", memory.peak},
+        {"total", memory.total},
+        {"allocations", memory.allocations},
+        {"frees", memory.frees},
+        {"growths", memory.growths},
+        {"instructions", vm->instructions},
+    };
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+        if (strlen(counters[i].name) == name->length && memcmp(counters[i].name, name->data, name->length) == 0)
+        {
+            *counter = (double)counters[i].value;
+            return true;
+        }
+    }
+
+    size_t objects[OBJECT_COUNT], bytes[OBJECT_COUNT];
+    for (size_t type = 0; type < OBJECT_COUNT; ++type)
+    {
+        const char *type_name = object_type_name((object_type_t)type);
+        if (strlen(type_name) == name->length && memcmp(type_name, name->data, name->length) == 0)
+        {
+            gc_census(objects, bytes);
+            *counter = (double)objects[type];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// memstats() is the live bytes, memstats("name") one of the counters, nil when unknown
+static value_t memstats(size_t args_count, value_t *args)
+{
+    if (args_count == 0)
+        return NUMBER_VAL((double)memory_stats().bytes);
+
+    double counter;
+    if (!IS_TEXT(args[0]) || !memory_counter(natives_vm, object_flatten(AS_OBJECT(args[0])), &counter))
+        return NIL_VAL;
+
+    return NUMBER_VAL(counter);
+}
+
+// builder() is empty, append(builder, text) adds to it in place and returns it,
+// build(builder) is the string it holds so far. Nil when the arguments don't fit.
+static value_t builder(UNUSED size_t args_count, UNUSED value_t *args)
+{
+    return OBJECT_VAL(object_builder_new());
+}
+
+static value_t append(size_t args_count, value_t *args)
+{
+    if (args_count != 2 || !IS_BUILDER(args[0]) || !IS_TEXT(args[1]))
+        return NIL_VAL;
+
+    object_builder_append(AS_BUILDER(args[0]), AS_OBJECT(args[1]));
+    return args[0];
+}
+
+static value_t build(size_t args_count, value_t *args)
 {
+    if (args_count != 1 || !IS_BUILDER(args[0]))
+        return NIL_VAL;
+
+    const object_builder_t *text = AS_BUILDER(args[0]);
+    return OBJECT_VAL(object_string_new(text->length > 0 ? text->data : "", text->length));
+}
+
+void vm_memory_print(const vm_t *vm)
+{
+    memory_stats_t memory = memory_stats();
+    const gc_stats_t *gc = gc_stats();
+
+    size_t made = 0;
+    for (size_t type = 0; type < OBJECT_COUNT; ++type)
+        made += gc->allocated[type];
+
+    double instructions = vm->instructions > 0 ? (double)vm->instructions : 1;
+
+    fprintf(stderr, "[MEM] bytes: %zu live, %zu peak, %zu total\n", memory.bytes, memory.peak, memory.total);
+    fprintf(stderr, "[MEM] allocations: %zu, frees: %zu, growths: %zu\n", memory.allocations, memory.frees, memory.growths);
+    fprintf(stderr, "[MEM] instructions: %zu, %.4f allocations and %.4f objects per instruction\n", vm->instructions,
+            (double)memory.allocations / instructions, (double)made / instructions);
+
+    size_t objects[OBJECT_COUNT], bytes[OBJECT_COUNT];
+    gc_census(objects, bytes);
+    for (size_t type = 0; type < OBJECT_COUNT; ++type)
+    {
+        fprintf(stderr, "[MEM] %-8s %zu made, %zu live, %zu bytes\n", object_type_name((object_type_t)type),
+                gc->allocated[type], objects[type], bytes[type]);
+    }
+}
+
+interpret_result_t vm_interpret(vm_t *vm, object_function_t *function, const compiler_options_t *options)
+{
+    vm->options = options;
+
     vm->frames.count = 1;
     vm->frames.items[0].function = function;
     vm->frames.items[0].ip = function->program.chunks.items;
     vm->frames.items[0].fp = vm->stack.items;
+    vm->frames.items[0].globals = &vm->globals;
 
-    define_native(vm, "clock", clk);
-
-    value_stack_push(&vm->stack, OBJECT_VAL(function));
-    call(vm, OBJECT_VAL(function), 0);
+    return run_nested(vm, function);
+}
 
-    return vm_run(vm);
+interpret_result_t vm_interpret_builtins(vm_t *vm, object_function_t *function, const compiler_options_t *options)
+{
+    bind_globals(function, &vm->builtins);
+    return vm_interpret(vm, function, options);
 }
 
 void vm_free(vm_t *vm)
 {
     value_stack_init(&vm->stack);
     table_free(&vm->globals);
+    table_free(&vm->builtins);
+    table_free(&vm->modules);
+    gc_free();
+}
+
+// Snapshots only fit the build that wrote them, the bytecode may differ in any other
+static uint64_t snapshot_key(void)
+{
+    return image_hash(CLOX_VERSION, sizeof(CLOX_VERSION) - 1, 0);
+}
+
+bool vm_snapshot_save(const vm_t *vm, const char *path)
+{
+    image_buffer_t buffer = {0};
+
+    bool saved = image_write_heap(&buffer, &vm->globals, snapshot_key()) && image_save(path, &buffer);
+
+    image_buffer_free(&buffer);
+    return saved;
+}
+
+bool vm_snapshot_load(vm_t *vm, const char *path)
+{
+    source_t image;
+    if (source_open(&image, path) != 0)
+        return false;
+
+    bool loaded = image_read_heap(image.data, image.length, snapshot_key(), &vm->globals);
+    source_close(&image);
+
+    return loaded;
 }
@@ -0,0 +1,85 @@
+// Crafted images the reader has to reject rather than hand to the VM
+#include "image.h"
+#include "memory.h"
+
+static int failures = 0;
+
+// Writes a function made of the code and the constant and reads it back
+static bool loads(const chunk *code, size_t length, size_t arity, value_t constant)
+{
+    object_function_t *function = object_function_new("crafted", arity);
+    chunk_array_append(&function->program.chunks, code, length);
+    value_array_write(&function->program.constants, constant);
+
+    image_buffer_t buffer = {0};
+    bool written = image_write(&buffer, function, 0);
+    bool read = written && image_read(buffer.data, buffer.length, 0) != NULL;
+    image_buffer_free(&buffer);
+
+    return read;
+}
+
+#define EXPECT(name, expected, ...)                                                     \
+    do                                                                                  \
+    {                                                                                   \
+        const chunk code[] = {__VA_ARGS__};                                             \
+        if (loads(code, sizeof(code), 1, NUMBER_VAL(1)) != (expected))                  \
+        {                                                                               \
+            fprintf(stderr, "FAIL %s: expected it to be %s\n", (name),                  \
+                    (expected) ? "read" : "rejected");                                  \
+            failures++;                                                                 \
+        }                                                                               \
+    } while (0)
+
+int main(void)
+{
+    EXPECT("return the argument", true, OP_GET_LOCAL, 0, 0, OP_RETURN);
+    EXPECT("jump over a constant", true, OP_JUMP, 0, 5, OP_CONSTANT, 0, OP_NIL, OP_RETURN);
+
+    EXPECT("jump out of the function", false, OP_JUMP, 0xFF, 0xFF, OP_NIL, OP_RETURN);
+    EXPECT("jump into an instruction", false, OP_JUMP, 0, 4, OP_CONSTANT, 0, OP_RETURN);
+    EXPECT("loop out of the function", false, OP_CONSTANT, 0, OP_LOOP_LESS, 0, 0, 0, 1, 0, 0xFF, 0xFF, OP_RETURN);
+    EXPECT("local past the frame", false, OP_GET_LOCAL, 0, 2, OP_RETURN);
+    EXPECT("set a local past the frame", false, OP_NIL, OP_SET_LOCAL, 0x10, 0, OP_RETURN);
+    EXPECT("call more arguments than pushed", false, OP_GET_LOCAL, 0, 0, OP_CALL, 3, OP_RETURN);
+    EXPECT("constant that doesn't exist", false, OP_CONSTANT, 1, OP_RETURN);
+    EXPECT("global named by a number", false, OP_GET_GLOBAL, 0, OP_RETURN);
+    EXPECT("member named by a number", false, OP_GET_LOCAL, 0, 0, OP_GET_MEMBER, 0, OP_RETURN);
+    EXPECT("pop an empty stack", false, OP_POP, OP_POP, OP_NIL, OP_RETURN);
+    EXPECT("run off the end", false, OP_NIL, OP_PRINT);
+    EXPECT("operand cut short", false, OP_NIL, OP_RETURN, OP_JUMP, 0);
+    EXPECT("unknown instruction", false, OP_COUNT, OP_NIL, OP_RETURN);
+
+    // Functions of another namespace can't be bound back to it
+    table_t globals, module;
+    table_init(&globals);
+    table_init(&module);
+    object_function_t *function = object_function_new("member", 0);
+    const chunk code[] = {OP_NIL, OP_RETURN};
+    chunk_array_append(&function->program.chunks, code, sizeof(code));
+    table_entry_set(&globals, object_string_new("g", 1), OBJECT_VAL(function));
+
+    image_buffer_t buffer = {0};
+    if (!image_write_heap(&buffer, &globals, 0))
+    {
+        fprintf(stderr, "FAIL script function: expected the heap to be written\n");
+        failures++;
+    }
+    image_buffer_free(&buffer);
+
+    function->globals = &module;
+    if (image_write_heap(&buffer, &globals, 0))
+    {
+        fprintf(stderr, "FAIL module function: expected the heap to be refused\n");
+        failures++;
+    }
+    image_buffer_free(&buffer);
+    table_free(&globals);
+    table_free(&module);
+
+    memory_pools_free();
+
+    if (failures == 0)
+        printf("All images checked\n");
+    return failures == 0 ? 0 : 1;
+}
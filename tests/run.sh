@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs every script of this directory with each set of flags and compares what it
+# prints with the .out next to it, the output of the unoptimized run. Every pass
+# also runs on its own so that one can't hide behind another
+interpreter=${1:-./main.o}
+dir=$(dirname "$0")
+failed=0
+
+for script in "$dir"/*.lox; do
+    for flags in "" "-O" "--lazy" "--lazy -O" "--stream" "--stream -O" \
+                 "-O=inline" "-O=propagate" "-O=cse" "-O=copy" "-O=fold" "-O=branch" "-O=dce"; do
+        if ! $interpreter $flags "$script" 2>&1 | cmp -s - "${script%.lox}.out"; then
+            echo "FAIL $script [$flags]"
+            failed=1
+        fi
+    done
+done
+
+[ $failed = 0 ] && echo "All scripts passed"
+exit $failed
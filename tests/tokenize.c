@@ -0,0 +1,115 @@
+// The token stream lexed in parallel chunks against the serial one, token for token
+#include "tokenizer.h"
+#include "memory.h"
+
+#define SOURCE_LENGTH (4 * 1024 * 1024) // Enough chunks for every thread count below
+
+static int failures = 0;
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+static size_t append(char *source, size_t length, const char *text)
+{
+    size_t n = strlen(text);
+    memcpy(source + length, text, n);
+    return length + n;
+}
+
+// Statements, comments and strings of every size, some of them running over many lines
+// so that chunk boundaries fall inside them. Unterminated leaves a string open at the end
+static char *generate(bool unterminated)
+{
+    static const char *pieces[] = {
+        "var x = 1;\n", "print x + 2.5 * (y - 3);\n", "fun f(a, b) { return a >= b; }\n",
+        "if (a != b and !c) { x = x / 2; }\n", "// A comment with a \"quote\"\n", "\n\n",
+        "while (i <= 10) i = i + 1;\n", "print \"short\";\n", "   \t  x.y;\n", "const z = nil;\n"};
+    const size_t pieces_count = sizeof(pieces) / sizeof(pieces[0]);
+
+    char *source = (char *)memory_allocate(NULL, SOURCE_LENGTH + 64 * 1024 + 1, false);
+    size_t length = 0;
+
+    while (length < SOURCE_LENGTH)
+    {
+        uint32_t roll = next_random() % 1000;
+        if (roll < 3)
+        {
+            // Up to about 20000 lines, longer than a chunk at times
+            length = append(source, length, "print \"");
+            size_t lines = next_random() % 20000;
+            for (size_t i = 0; i < lines; ++i)
+                length = append(source, length, i % 3 == 0 ? "line\n" : "\n");
+            length = append(source, length, "end\";\n");
+        }
+        else
+        {
+            length = append(source, length, pieces[roll % pieces_count]);
+        }
+    }
+
+    if (unterminated)
+        length = append(source, length, "print \"open\nto the end\n");
+    source[length] = '\0';
+
+    return source;
+}
+
+static void compare(const char *name, const char *source, size_t threads)
+{
+    tokenizer_t serial_tokenizer, parallel_tokenizer;
+    tokenizer_init(&serial_tokenizer, source);
+    tokenizer_init(&parallel_tokenizer, source);
+
+    token_stream_t serial, parallel;
+    token_stream_build(&serial, &serial_tokenizer, 1);
+    token_stream_build(&parallel, &parallel_tokenizer, threads);
+
+    size_t i = 0;
+    if (serial.count != parallel.count)
+    {
+        fprintf(stderr, "FAIL %s, %zu threads: %zu tokens instead of %zu\n", name, threads, parallel.count, serial.count);
+        failures++;
+    }
+    else
+    {
+        for (; i < serial.count; ++i)
+        {
+            if (serial.types[i] != parallel.types[i] || serial.offsets[i] != parallel.offsets[i] ||
+                serial.lengths[i] != parallel.lengths[i] || serial.lines[i] != parallel.lines[i])
+            {
+                fprintf(stderr, "FAIL %s, %zu threads: token %zu differs\n", name, threads, i);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    token_stream_free(&serial);
+    token_stream_free(&parallel);
+}
+
+int main(void)
+{
+    static const size_t threads[] = {2, 3, 7, 12};
+
+    for (int unterminated = 0; unterminated <= 1; ++unterminated)
+    {
+        char *source = generate(unterminated);
+        const char *name = unterminated ? "unterminated string" : "multi-line strings";
+
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t)
+            compare(name, source, threads[t]);
+
+        memory_free(source);
+    }
+
+    memory_pools_free();
+
+    if (failures == 0)
+        printf("All token streams match\n");
+    return failures == 0 ? 0 : 1;
+}